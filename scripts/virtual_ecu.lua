@@ -15,8 +15,9 @@ UDS:
 obd_req   = { 0x7df, 0x7e4 }
 obd_resp  = 0x7ec
 
-uds_req  = 0x18DA0BFA
-uds_resp = 0x18DAFA0B
+-- can be overridden per instance, see fleet.json
+uds_req  = node_params.uds_req or 0x18DA0BFA
+uds_resp = node_params.uds_resp or 0x18DAFA0B
 
 supported_sessions = { 0x01, 0x02 }
 current_session = 0x01
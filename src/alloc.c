@@ -0,0 +1,237 @@
+/*
+	Bulwa CAN Simulator
+	Copyright (C) 2024 Szymon Morawski
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "global.h"
+
+/*
+ * Blocks up to ALLOC_POOL_MAX bytes are served from size classes
+ * ALLOC_GRANULE bytes apart, carved out of slabs and recycled through
+ * free lists. Lua always passes the old size of a block, so no
+ * per block header is needed. Larger blocks go to malloc.
+ */
+#define ALLOC_GRANULE	16
+#define ALLOC_POOL_MAX	256
+#define ALLOC_CLASSES	(ALLOC_POOL_MAX / ALLOC_GRANULE)
+#define ALLOC_SLAB_SIZE	(64 * 1024)
+
+struct AllocSlab
+{
+	struct AllocSlab *next;
+};
+
+struct AllocBlock
+{
+	struct AllocBlock *next;
+};
+
+struct LuaAllocator
+{
+	size_t live;
+	size_t peak;
+	size_t limit;
+	bool enforced;
+	bool limit_hit;
+	struct AllocBlock *free_lists[ALLOC_CLASSES];
+	struct AllocSlab *slabs;
+	char *slab_pos;
+	size_t slab_left;
+};
+
+static void *alloc_lua(void *ud, void *ptr, size_t osize, size_t nsize);
+static int alloc_panic(lua_State *lua);
+static void *alloc_get(struct LuaAllocator *alloc, size_t size);
+static void alloc_put(struct LuaAllocator *alloc, void *ptr, size_t size);
+
+static inline int alloc_class(size_t size)
+{
+	return (size + ALLOC_GRANULE - 1) / ALLOC_GRANULE - 1;
+}
+
+struct LuaAllocator *alloc_create(size_t limit)
+{
+	struct LuaAllocator *alloc = (struct LuaAllocator *)calloc(1, sizeof(struct LuaAllocator));
+	if (alloc)
+		alloc->limit = limit;
+	return alloc;
+}
+
+void alloc_destroy(struct LuaAllocator *alloc)
+{
+	if (!alloc)
+		return;
+	struct AllocSlab *slab = alloc->slabs;
+	while (slab)
+	{
+		struct AllocSlab *next = slab->next;
+		free(slab);
+		slab = next;
+	}
+	free(alloc);
+}
+
+lua_State *alloc_newstate(struct LuaAllocator *alloc)
+{
+	lua_State *lua = lua_newstate(alloc_lua, alloc);
+	if (lua)
+		lua_atpanic(lua, alloc_panic);
+	return lua;
+}
+
+// turns the limit on or off, returns the previous setting
+bool alloc_enforce(struct LuaAllocator *alloc, bool enforced)
+{
+	if (!alloc)
+		return false;
+	bool prev = alloc->enforced;
+	alloc->enforced = enforced;
+	return prev;
+}
+
+void alloc_get_stats(const struct LuaAllocator *alloc, size_t *live, size_t *peak, size_t *limit)
+{
+	*live = alloc->live;
+	*peak = alloc->peak;
+	*limit = alloc->limit;
+}
+
+// tells whether an allocation has been refused since the last call
+bool alloc_limit_hit(struct LuaAllocator *alloc)
+{
+	bool hit = alloc->limit_hit;
+	alloc->limit_hit = false;
+	return hit;
+}
+
+static void *alloc_lua(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+	struct LuaAllocator *alloc = (struct LuaAllocator *)ud;
+	// for new blocks osize encodes the type of an object
+	if (!ptr)
+		osize = 0;
+
+	if (0 == nsize)
+	{
+		if (ptr)
+		{
+			alloc_put(alloc, ptr, osize);
+			alloc->live -= osize;
+		}
+		return NULL;
+	}
+
+	// shrinking must never fail
+	if (nsize > osize && alloc->enforced && alloc->limit &&
+		alloc->live - osize + nsize > alloc->limit)
+	{
+		alloc->limit_hit = true;
+		return NULL;
+	}
+
+	void *nptr;
+	if (ptr && osize > ALLOC_POOL_MAX && nsize > ALLOC_POOL_MAX)
+	{
+		nptr = realloc(ptr, nsize);
+	}
+	else if (ptr && osize <= ALLOC_POOL_MAX && nsize <= ALLOC_POOL_MAX &&
+		alloc_class(osize) == alloc_class(nsize))
+	{
+		nptr = ptr;
+	}
+	else
+	{
+		nptr = alloc_get(alloc, nsize);
+		if (nptr && ptr)
+		{
+			memcpy(nptr, ptr, osize < nsize ? osize : nsize);
+			alloc_put(alloc, ptr, osize);
+		}
+	}
+	if (!nptr)
+		return NULL;
+
+	alloc->live = alloc->live - osize + nsize;
+	if (alloc->live > alloc->peak)
+		alloc->peak = alloc->live;
+	return nptr;
+}
+
+// same as the panic function installed by luaL_newstate
+static int alloc_panic(lua_State *lua)
+{
+	const char *msg = lua_tostring(lua, -1);
+	fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+		msg ? msg : "error object is not a string");
+	return 0;
+}
+
+static void *alloc_get(struct LuaAllocator *alloc, size_t size)
+{
+	if (size > ALLOC_POOL_MAX)
+		return malloc(size);
+
+	int cls = alloc_class(size);
+	struct AllocBlock *block = alloc->free_lists[cls];
+	if (block)
+	{
+		alloc->free_lists[cls] = block->next;
+		return block;
+	}
+
+	size_t block_size = (cls + 1) * ALLOC_GRANULE;
+	if (alloc->slab_left < block_size)
+	{
+		// the tail of the current slab goes to the free lists
+		while (alloc->slab_left >= ALLOC_GRANULE)
+		{
+			size_t tail_size = alloc->slab_left - alloc->slab_left % ALLOC_GRANULE;
+			if (tail_size > ALLOC_POOL_MAX)
+				tail_size = ALLOC_POOL_MAX;
+			alloc_put(alloc, alloc->slab_pos, tail_size);
+			alloc->slab_pos += tail_size;
+			alloc->slab_left -= tail_size;
+		}
+
+		struct AllocSlab *slab = (struct AllocSlab *)malloc(ALLOC_SLAB_SIZE);
+		if (!slab)
+			return NULL;
+		slab->next = alloc->slabs;
+		alloc->slabs = slab;
+		// keep blocks aligned the same way malloc does
+		alloc->slab_pos = (char *)slab + ALLOC_GRANULE;
+		alloc->slab_left = ALLOC_SLAB_SIZE - ALLOC_GRANULE;
+	}
+
+	void *ptr = alloc->slab_pos;
+	alloc->slab_pos += block_size;
+	alloc->slab_left -= block_size;
+	return ptr;
+}
+
+static void alloc_put(struct LuaAllocator *alloc, void *ptr, size_t size)
+{
+	if (size > ALLOC_POOL_MAX)
+	{
+		free(ptr);
+		return;
+	}
+
+	int cls = alloc_class(size);
+	struct AllocBlock *block = (struct AllocBlock *)ptr;
+	block->next = alloc->free_lists[cls];
+	alloc->free_lists[cls] = block;
+}
@@ -0,0 +1,259 @@
+/*
+	Bulwa CAN Simulator
+	Copyright (C) 2024 Szymon Morawski
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "global.h"
+
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#define BCCACHE_DIR_NAME ".bulwa_cache"
+
+/*
+ * A cache file consists of this header, the script path
+ * (path_len bytes) and the precompiled chunk (chunk_len bytes).
+ * The entry is valid only if all the fields match the script
+ * being loaded and the Lua build the simulator is linked with.
+ */
+struct BytecodeCacheHeader
+{
+	char magic[4];
+	uint32_t lua_version;
+	char lua_release[32];
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int64_t size;
+	uint32_t path_len;
+	uint32_t chunk_len;
+};
+
+struct ChunkBuffer
+{
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+static const char bccache_magic[4] = { 'B', 'L', 'W', 'C' };
+static char *cache_dir = NULL;
+
+static void bccache_fill_header(struct BytecodeCacheHeader *hdr,
+	const char *real_path, const struct stat *st);
+static char *bccache_entry_path(const char *real_path);
+static bool bccache_read(lua_State *lua, const char *script_path,
+	const char *real_path, const char *entry_path, const struct stat *st);
+static void bccache_write(lua_State *lua, const char *real_path,
+	const char *entry_path, const struct stat *st);
+static int bccache_writer(lua_State *lua, const void *p, size_t sz, void *ud);
+
+int bccache_init(const char *config_path)
+{
+	bccache_deinit();
+
+	// the cache lives next to the configuration file
+	const char *slash = strrchr(config_path, '/');
+	size_t dir_len = slash ? (size_t)(slash - config_path) : 0;
+	size_t len = dir_len + sizeof("/" BCCACHE_DIR_NAME);
+	cache_dir = (char *)malloc(len + 1);
+	if (slash)
+		snprintf(cache_dir, len + 1, "%.*s/%s", (int)dir_len, config_path, BCCACHE_DIR_NAME);
+	else
+		snprintf(cache_dir, len + 1, "%s", BCCACHE_DIR_NAME);
+
+	if (mkdir(cache_dir, 0755) < 0 && EEXIST != errno)
+	{
+		fprintf(stderr, "warning: cannot create bytecode cache directory %s\n", cache_dir);
+		bccache_deinit();
+		return RC_CONFIGFILE;
+	}
+	return RC_OK;
+}
+
+void bccache_deinit(void)
+{
+	free(cache_dir);
+	cache_dir = NULL;
+}
+
+// works like luaL_loadfile, hit tells whether the cache was used
+int bccache_load(lua_State *lua, const char *script_path, bool *hit)
+{
+	*hit = false;
+
+	// key entries by the canonical path, so that the same script
+	// referenced in different ways shares a single entry
+	struct stat st;
+	char real_path[PATH_MAX];
+	char *entry_path = NULL;
+	if (cache_dir && 0 == stat(script_path, &st) && realpath(script_path, real_path))
+		entry_path = bccache_entry_path(real_path);
+
+	if (entry_path && bccache_read(lua, script_path, real_path, entry_path, &st))
+	{
+		*hit = true;
+		free(entry_path);
+		return 0;
+	}
+
+	int err = luaL_loadfile(lua, script_path);
+	if (!err && entry_path)
+		bccache_write(lua, real_path, entry_path, &st);
+	free(entry_path);
+	return err;
+}
+
+static void bccache_fill_header(struct BytecodeCacheHeader *hdr,
+	const char *real_path, const struct stat *st)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	memcpy(hdr->magic, bccache_magic, sizeof(hdr->magic));
+	hdr->lua_version = LUA_VERSION_NUM;
+	strncpy(hdr->lua_release, BULWA_LUA_RELEASE, sizeof(hdr->lua_release) - 1);
+	hdr->mtime_sec = st->st_mtim.tv_sec;
+	hdr->mtime_nsec = st->st_mtim.tv_nsec;
+	hdr->size = st->st_size;
+	hdr->path_len = strlen(real_path);
+}
+
+static char *bccache_entry_path(const char *real_path)
+{
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (const char *c = real_path; *c; ++c)
+	{
+		hash ^= (unsigned char)*c;
+		hash *= 0x100000001b3ULL;
+	}
+
+	size_t len = strlen(cache_dir) + 1 + 16 + sizeof(".luac");
+	char *path = (char *)malloc(len);
+	snprintf(path, len, "%s/%016llx.luac", cache_dir, (unsigned long long)hash);
+	return path;
+}
+
+static bool bccache_read(lua_State *lua, const char *script_path,
+	const char *real_path, const char *entry_path, const struct stat *st)
+{
+	FILE *file = fopen(entry_path, "rb");
+	if (!file)
+		return false;
+
+	bool ok = false;
+	char *path = NULL;
+	char *chunk = NULL;
+	struct BytecodeCacheHeader expected, hdr;
+	bccache_fill_header(&expected, real_path, st);
+	if (1 != fread(&hdr, sizeof(hdr), 1, file))
+		goto out;
+	expected.chunk_len = hdr.chunk_len;
+	if (memcmp(&expected, &hdr, sizeof(hdr)))
+		goto out;
+
+	// the chunk fills the rest of the file, a corrupted length must
+	// not turn into a huge allocation or a short read
+	struct stat file_st;
+	if (fstat(fileno(file), &file_st) < 0 || !hdr.chunk_len ||
+		(uint64_t)file_st.st_size != sizeof(hdr) + (uint64_t)hdr.path_len + hdr.chunk_len)
+	{
+		goto out;
+	}
+
+	path = (char *)malloc(hdr.path_len);
+	chunk = (char *)malloc(hdr.chunk_len);
+	if (!path || !chunk)
+		goto out;
+	if (1 != fread(path, hdr.path_len, 1, file))
+		goto out;
+	if (memcmp(path, real_path, hdr.path_len))
+		goto out;
+	if (1 != fread(chunk, hdr.chunk_len, 1, file))
+		goto out;
+
+	// keep the chunk name identical to luaL_loadfile
+	lua_pushfstring(lua, "@%s", script_path);
+	const char *chunk_name = lua_tostring(lua, -1);
+	int err = luaL_loadbufferx(lua, chunk, hdr.chunk_len, chunk_name, "b");
+	lua_remove(lua, -2);
+	if (err)
+		lua_pop(lua, 1);
+	else
+		ok = true;
+
+out:
+	free(chunk);
+	free(path);
+	fclose(file);
+	return ok;
+}
+
+static void bccache_write(lua_State *lua, const char *real_path,
+	const char *entry_path, const struct stat *st)
+{
+	struct ChunkBuffer buf = { NULL, 0, 0 };
+	// keep debug information, error messages need line numbers
+	if (lua_dump(lua, bccache_writer, &buf, 0) || !buf.len)
+	{
+		free(buf.data);
+		return;
+	}
+
+	struct BytecodeCacheHeader hdr;
+	bccache_fill_header(&hdr, real_path, st);
+	hdr.chunk_len = buf.len;
+
+	// several nodes may run the same script, so write a private
+	// file first and move it into place atomically
+	size_t len = strlen(entry_path) + 32;
+	char *tmp_path = (char *)malloc(len);
+	snprintf(tmp_path, len, "%s.%d.%lx", entry_path, (int)getpid(),
+		(unsigned long)(uintptr_t)lua);
+
+	FILE *file = fopen(tmp_path, "wb");
+	if (file)
+	{
+		bool ok = 1 == fwrite(&hdr, sizeof(hdr), 1, file) &&
+			1 == fwrite(real_path, hdr.path_len, 1, file) &&
+			1 == fwrite(buf.data, buf.len, 1, file);
+		ok = (0 == fclose(file)) && ok;
+		if (!ok || rename(tmp_path, entry_path) < 0)
+			unlink(tmp_path);
+	}
+
+	free(tmp_path);
+	free(buf.data);
+}
+
+static int bccache_writer(lua_State *lua, const void *p, size_t sz, void *ud)
+{
+	struct ChunkBuffer *buf = (struct ChunkBuffer *)ud;
+	if (buf->len + sz > buf->cap)
+	{
+		size_t cap = buf->cap ? buf->cap : 4096;
+		while (cap < buf->len + sz)
+			cap *= 2;
+		char *data = (char *)realloc(buf->data, cap);
+		if (!data)
+			return 1;
+		buf->data = data;
+		buf->cap = cap;
+	}
+	memcpy(buf->data + buf->len, p, sz);
+	buf->len += sz;
+	return 0;
+}
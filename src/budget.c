@@ -0,0 +1,164 @@
+/*
+	Bulwa CAN Simulator
+	Copyright (C) 2024 Szymon Morawski
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "global.h"
+
+#include <time.h>
+
+/*
+ * A callback is charged with the instructions and the wall time
+ * from its start, checked by the count hook of the node. Once it
+ * goes over either limit, the hook raises an error (see node_hook)
+ * and keeps raising it on every following instruction, so that
+ * scripts catching errors with pcall cannot keep running. Calls of
+ * the node nested in a callback (e.g. disable_node) are charged to
+ * the outer one.
+ */
+struct Budget
+{
+	unsigned long long instructions;	// per callback, 0 if unlimited
+	unsigned long long time_ns;		// per callback, 0 if unlimited
+	int quarantine;			// overruns disabling the node, 0 for never
+	int hook_count;
+
+	// the running callback
+	int depth;
+	unsigned long long start;
+	unsigned long long executed;
+	const char *callback;
+	bool exceeded;
+	char message[128];
+
+	unsigned long long overruns;
+	int strikes;			// overruns since the node has been enabled
+	unsigned long long longest_ns;
+};
+
+static inline unsigned long long budget_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// returns NULL if there is no limit
+struct Budget *budget_create(unsigned long long instructions, unsigned long long time_us,
+	int quarantine)
+{
+	if (!instructions && !time_us)
+		return NULL;
+	struct Budget *budget = (struct Budget *)calloc(1, sizeof(struct Budget));
+	if (!budget)
+		return NULL;
+	budget->instructions = instructions;
+	budget->time_ns = time_us * 1000;
+	budget->quarantine = quarantine;
+	// small instruction budgets need a finer check
+	budget->hook_count = NODE_HOOK_COUNT;
+	if (instructions && instructions < NODE_HOOK_COUNT)
+		budget->hook_count = instructions;
+	return budget;
+}
+
+void budget_destroy(struct Budget *budget)
+{
+	free(budget);
+}
+
+int budget_get_hook_count(const struct Budget *budget)
+{
+	return budget->hook_count;
+}
+
+// callback is a string literal naming the callback, used in messages
+void budget_begin(struct Budget *budget, const char *callback)
+{
+	if (budget->depth++)
+		return;
+	budget->start = budget_now();
+	budget->executed = 0;
+	budget->callback = callback;
+	budget->exceeded = false;
+}
+
+// returns true once the outermost call has ended
+bool budget_end(struct Budget *budget)
+{
+	if (--budget->depth)
+		return false;
+	unsigned long long elapsed = budget_now() - budget->start;
+	if (elapsed > budget->longest_ns)
+		budget->longest_ns = elapsed;
+	return true;
+}
+
+// called by the count hook of the node, returns true if the running
+// callback is to be aborted with the error given by budget_get_message
+bool budget_hook(struct Budget *budget)
+{
+	if (!budget->depth)
+		return false;
+	if (!budget->exceeded)
+	{
+		budget->executed += budget->hook_count;
+		if (budget->instructions && budget->executed >= budget->instructions)
+			snprintf(budget->message, sizeof(budget->message),
+				"%s exceeded its budget of %llu instructions",
+				budget->callback, budget->instructions);
+		else if (budget->time_ns && budget_now() - budget->start >= budget->time_ns)
+			snprintf(budget->message, sizeof(budget->message),
+				"%s exceeded its budget of %llu us",
+				budget->callback, budget->time_ns / 1000);
+		else
+			return false;
+		budget->exceeded = true;
+		++budget->overruns;
+		++budget->strikes;
+	}
+	return true;
+}
+
+const char *budget_get_message(const struct Budget *budget)
+{
+	return budget->message;
+}
+
+// tells whether the last callback has been aborted
+bool budget_exceeded(const struct Budget *budget)
+{
+	return budget->exceeded;
+}
+
+// tells whether the node has run out of its overruns
+bool budget_quarantine(const struct Budget *budget)
+{
+	return budget->quarantine && budget->strikes >= budget->quarantine;
+}
+
+// a node starts with a clean record when it is enabled
+void budget_reset(struct Budget *budget)
+{
+	budget->strikes = 0;
+}
+
+void budget_get_stats(const struct Budget *budget, unsigned long long *overruns,
+	unsigned long long *longest_us)
+{
+	*overruns = budget->overruns;
+	*longest_us = budget->longest_ns / 1000;
+}
@@ -19,8 +19,36 @@
 #include "global.h"
 
 #include <cjson/cJSON.h>
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+
+struct NodeLoadJobs
+{
+	pthread_mutex_t lock;
+	cJSON **items;
+	int *first;		// index of the first node of an entry
+	int *count;		// number of instances of an entry
+	int num;
+	int next;
+	int *results;
+	bool *cache_hits;
+	double *load_ms;
+};
 
 static cJSON *config = NULL;
+static char *config_path = NULL;
+
+static int config_get_instance_num(cJSON *node_item);
+static int config_load_node(cJSON *node_item, int first, int count);
+static int config_run_node(struct ScriptNode *node);
+static char *config_instance_name(const char *name, int idx, bool instanced);
+static void config_push_params(lua_State *lua, cJSON *params_item, int idx);
+static bool config_get_size(cJSON *item, size_t *size);
+static lua_Integer config_get_integer(cJSON *item, lua_Integer def);
+static void *config_load_worker(void *arg);
+static double config_elapsed_ms(const struct timespec *start);
 
 int config_load(const char *path)
 {
@@ -39,6 +67,9 @@ int config_load(const char *path)
 	free(config_string);
 	fclose(file);
 
+	free(config_path);
+	config_path = strdup(path);
+
 	return RC_OK;
 }
 
@@ -47,6 +78,8 @@ void config_unload(void)
 	if (config)
 		free(config);
 	config = NULL;
+	free(config_path);
+	config_path = NULL;
 }
 
 int config_get_node_num(void)
@@ -54,51 +87,590 @@ int config_get_node_num(void)
 	cJSON *nodes_array = cJSON_GetObjectItem(config, "nodes");
 	if (!nodes_array)
 		return 0;
-	return cJSON_GetArraySize(nodes_array);
+	int num = 0;
+	cJSON *node_item;
+	cJSON_ArrayForEach(node_item, nodes_array)
+		num += config_get_instance_num(node_item);
+	return num;
 }
 
-int config_load_node(int idx, struct ScriptNode *node)
+static int config_get_instance_num(cJSON *node_item)
 {
-	cJSON *nodes_array = cJSON_GetObjectItem(config, "nodes");
-	if (!nodes_array)
-		return RC_CONFIGFILE;
-	cJSON *node_item = cJSON_GetArrayItem(nodes_array, idx);
-	if (!node_item)
-		return RC_CONFIGFILE;
+	// a node entry with count > 1 is a template
+	cJSON *count_item = cJSON_GetObjectItem(node_item, "count");
+	if (!cJSON_IsNumber(count_item))
+		return 1;
+	int count = (int)cJSON_GetNumberValue(count_item);
+	return count > 0 ? count : 0;
+}
+
+static int config_load_node(cJSON *node_item, int first, int count)
+{
+	if (!count)
+		return RC_OK;
+	bool instanced = count > 1;
 
 	// name string
 	cJSON *name_string_item = cJSON_GetObjectItem(node_item, "name");
-	node->name = cJSON_GetStringValue(name_string_item);
+	const char *name = cJSON_GetStringValue(name_string_item);
+	if (!name)
+		name = "";
 
 	// enabled flag (turned on by default)
 	cJSON *enabled_flag_item = cJSON_GetObjectItem(node_item, "enabled");
-	node->enabled = !cJSON_IsFalse(enabled_flag_item);
+	bool enabled = !cJSON_IsFalse(enabled_flag_item);
 
 	// path string
 	cJSON *path_string_item = cJSON_GetObjectItem(node_item, "path");
 	char *script_path = cJSON_GetStringValue(path_string_item);
 
-	// initialize Lua environment
-	int err = RC_OK;
-	node->lua = luaL_newstate();
-	luaL_openlibs(node->lua);
-	luaenv_add_custom_api(node->lua, idx);
-	err = luaL_loadfile(node->lua, script_path);
+	// per instance parameters
+	cJSON *params_item = cJSON_GetObjectItem(node_item, "params");
+
+	// memory limit of a single instance, unlimited by default
+	cJSON *limit_item = cJSON_GetObjectItem(node_item, "memory_limit");
+	size_t limit;
+	if (!config_get_size(limit_item, &limit) || (limit && (size_t)count > SIZE_MAX / limit))
+	{
+		fprintf(stderr, "%s: invalid memory_limit\n", name);
+		return RC_CONFIGFILE;
+	}
+	limit *= count;
+
+	// sampling profiler, true or a period in microseconds
+	cJSON *profile_item = cJSON_GetObjectItem(node_item, "profile");
+	bool profiled = cJSON_IsTrue(profile_item) ||
+		(cJSON_IsNumber(profile_item) && cJSON_GetNumberValue(profile_item) > 0);
+	unsigned long long period = cJSON_IsNumber(profile_item) ?
+		(unsigned long long)cJSON_GetNumberValue(profile_item) : 0;
+
+	// execution budget of a single callback, unlimited by default
+	cJSON *budget_item = cJSON_GetObjectItem(node_item, "budget");
+	lua_Integer budget_instructions = config_get_integer(cJSON_GetObjectItem(budget_item, "instructions"), 0);
+	lua_Integer budget_time = config_get_integer(cJSON_GetObjectItem(budget_item, "time"), 0);
+	lua_Integer quarantine = config_get_integer(cJSON_GetObjectItem(budget_item, "quarantine"), 3);
+	bool budgeted = budget_instructions > 0 || budget_time > 0;
+	if (budget_instructions < 0)
+		budget_instructions = 0;
+	if (budget_time < 0)
+		budget_time = 0;
+
+	for (int i = 0; i < count; ++i)
+	{
+		struct ScriptNode *node = &nodes[first + i];
+		node->name = config_instance_name(name, i, instanced);
+		node->enabled = enabled;
+		node->instance = i;
+		node->env_ref = LUA_NOREF;
+		node->chunk_ref = LUA_NOREF;
+	}
+
+	// initialize Lua environment, shared by all instances of a template
+	struct LuaAllocator *alloc = alloc_create(limit);
+	lua_State *lua = alloc ? alloc_newstate(alloc) : NULL;
+	if (!lua)
+	{
+		// e.g. 64-bit LuaJIT without GC64 refuses custom allocators
+		if (limit)
+			fprintf(stderr, "warning: %s: custom allocator not supported, memory limit ignored\n", name);
+		alloc_destroy(alloc);
+		alloc = NULL;
+		lua = luaL_newstate();
+	}
+	nodes[first].lua = lua;
+	nodes[first].owns_lua = true;
+	nodes[first].alloc = alloc;
+	luaL_openlibs(lua);
+	luaenv_add_custom_api(lua);
+#ifdef BULWA_LUAJIT
+	if (RC_OK != luaenv_add_ffi_api(lua))
+		return RC_INIT;
+	// compiled traces do not run hooks, so budgets could not be enforced
+	if (budgeted)
+		luaJIT_setmode(lua, 0, LUAJIT_MODE_ENGINE | LUAJIT_MODE_OFF);
+#endif
+	bool hit = false;
+	int err = bccache_load(lua, script_path, &hit);
 	if (err)
 	{
-		const char *err_string = luaL_checkstring(node->lua, -1);
-		fprintf(stderr, "%s: %s\n", node->name, err_string);
+		node_report_error(&nodes[first], err);
 		return RC_LOADFILE;
 	}
-	err = lua_pcall(node->lua, 0, 0, 0);
-	if (err)
+
+	if (!instanced)
 	{
-		fprintf(stderr, "%s: %s\n", node->name, lua_tostring(node->lua, -1));
-		return RC_CALL;
+		// the main chunk is left on the stack and executed later
+		// by config_run_node, the node API goes to globals
+		lua_pushglobaltable(lua);
+		luaenv_add_node_api(lua, first);
+		config_push_params(lua, params_item, 0);
+		lua_setfield(lua, -2, "node_params");
+		lua_pop(lua, 1);
+		if (budgeted)
+		{
+			nodes[first].budget = budget_create(budget_instructions, budget_time, quarantine);
+			node_update_hook(&nodes[first]);
+		}
+		if (profiled)
+			profiler_start(&nodes[first], period);
+		return hit ? RC_CACHED : RC_OK;
 	}
+
+	// every instance runs the same compiled chunk in its own
+	// thread and environment, the first one uses the main thread
+	int chunk_ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+	for (int i = 0; i < count; ++i)
+	{
+		struct ScriptNode *node = &nodes[first + i];
+		if (i)
+		{
+			node->lua = lua_newthread(lua);
+			// anchor the thread for the lifetime of the state
+			luaL_ref(lua, LUA_REGISTRYINDEX);
+		}
+		node->chunk_ref = chunk_ref;
+		node->alloc = alloc;
+
+		luaenv_push_instance_env(lua);
+		luaenv_add_node_api(lua, first + i);
+		config_push_params(lua, params_item, i);
+		lua_setfield(lua, -2, "node_params");
+		node->env_ref = luaL_ref(lua, LUA_REGISTRYINDEX);
+		if (budgeted)
+		{
+			node->budget = budget_create(budget_instructions, budget_time, quarantine);
+			node_update_hook(node);
+		}
+		if (profiled)
+			profiler_start(node, period);
+	}
+	return hit ? RC_CACHED : RC_OK;
+}
+
+static int config_run_node(struct ScriptNode *node)
+{
+	if (LUA_NOREF != node->chunk_ref)
+	{
+		lua_rawgeti(node->lua, LUA_REGISTRYINDEX, node->chunk_ref);
+		lua_rawgeti(node->lua, LUA_REGISTRYINDEX, node->env_ref);
+		luaenv_set_chunk_env(node->lua, -2);
+	}
+	int err = node_pcall(node, 0, 0);
+	if (err)
+		return node_report_error(node, err);
 	return RC_OK;
 }
 
+/*
+ * The first "%d" in the name of a template is replaced by
+ * the instance index, otherwise the index is appended.
+ */
+static char *config_instance_name(const char *name, int idx, bool instanced)
+{
+	if (!instanced)
+		return strdup(name);
+
+	const char *marker = strstr(name, "%d");
+	size_t len = strlen(name) + 16;
+	char *instance_name = (char *)malloc(len);
+	if (marker)
+		snprintf(instance_name, len, "%.*s%d%s", (int)(marker - name), name, idx, marker + 2);
+	else
+		snprintf(instance_name, len, "%s %d", name, idx);
+	return instance_name;
+}
+
+/*
+ * Pushes the node_params table of an instance. Arrays provide
+ * one value per instance, objects with "base" (and optional "step",
+ * 1 by default) yield base + idx * step, other values are copied.
+ * Numbers of base and step may be given as strings, e.g. "0x18DA00FA".
+ */
+static void config_push_params(lua_State *lua, cJSON *params_item, int idx)
+{
+	lua_newtable(lua);
+	cJSON *param;
+	cJSON_ArrayForEach(param, params_item)
+	{
+		if (!param->string)
+			continue;
+		cJSON *value = param;
+		if (cJSON_IsArray(param))
+		{
+			value = cJSON_GetArrayItem(param, idx);
+		}
+		else if (cJSON_IsObject(param))
+		{
+			lua_Integer base = config_get_integer(cJSON_GetObjectItem(param, "base"), 0);
+			lua_Integer step = config_get_integer(cJSON_GetObjectItem(param, "step"), 1);
+			lua_pushinteger(lua, base + idx * step);
+			lua_setfield(lua, -2, param->string);
+			continue;
+		}
+
+		if (cJSON_IsNumber(value))
+		{
+			double number = cJSON_GetNumberValue(value);
+			if (number == (lua_Integer)number)
+				lua_pushinteger(lua, (lua_Integer)number);
+			else
+				lua_pushnumber(lua, number);
+		}
+		else if (cJSON_IsString(value))
+			lua_pushstring(lua, cJSON_GetStringValue(value));
+		else if (cJSON_IsBool(value))
+			lua_pushboolean(lua, cJSON_IsTrue(value));
+		else
+			continue;
+		lua_setfield(lua, -2, param->string);
+	}
+}
+
+// a number of bytes or a string with an optional K, M or G suffix,
+// a missing item is zero, a negative or out of range value is rejected
+static bool config_get_size(cJSON *item, size_t *size)
+{
+	*size = 0;
+	if (cJSON_IsNumber(item))
+	{
+		double value = cJSON_GetNumberValue(item);
+		if (!isfinite(value) || value < 0 || value >= (double)SIZE_MAX)
+			return false;
+		*size = (size_t)value;
+		return true;
+	}
+	if (!cJSON_IsString(item))
+		return !item || cJSON_IsNull(item);
+
+	// strtoull() silently negates a leading minus sign
+	const char *str = cJSON_GetStringValue(item);
+	if (strchr(str, '-'))
+		return false;
+	char *suffix;
+	errno = 0;
+	unsigned long long value = strtoull(str, &suffix, 0);
+	if (suffix == str || ERANGE == errno || value > SIZE_MAX)
+		return false;
+
+	int shift = 0;
+	switch (*suffix)
+	{
+	case 'G': case 'g':
+		shift = 30;
+		break;
+	case 'M': case 'm':
+		shift = 20;
+		break;
+	case 'K': case 'k':
+		shift = 10;
+		break;
+	case '\0':
+		break;
+	default:
+		return false;
+	}
+	if (shift && suffix[1])
+		return false;
+	if (value > SIZE_MAX >> shift)
+		return false;
+	*size = (size_t)value << shift;
+	return true;
+}
+
+static lua_Integer config_get_integer(cJSON *item, lua_Integer def)
+{
+	if (cJSON_IsNumber(item))
+		return (lua_Integer)cJSON_GetNumberValue(item);
+	if (cJSON_IsString(item))
+		return (lua_Integer)strtoll(cJSON_GetStringValue(item), NULL, 0);
+	return def;
+}
+
+int config_load_nodes(struct ScriptNode *nodes, int num)
+{
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	// bytecode cache is turned on by default
+	cJSON *cache_flag_item = cJSON_GetObjectItem(config, "bytecode_cache");
+	if (cJSON_IsFalse(cache_flag_item))
+		bccache_deinit();
+	else
+		bccache_init(config_path);
+
+	cJSON *nodes_array = cJSON_GetObjectItem(config, "nodes");
+	int entries_num = cJSON_GetArraySize(nodes_array);
+
+	// entries do not share their Lua states, so they can be
+	// created and compiled in parallel
+	int threads_num = sysconf(_SC_NPROCESSORS_ONLN);
+	cJSON *threads_item = cJSON_GetObjectItem(config, "init_threads");
+	if (cJSON_IsNumber(threads_item))
+		threads_num = (int)cJSON_GetNumberValue(threads_item);
+	if (threads_num > entries_num)
+		threads_num = entries_num;
+	if (threads_num < 1)
+		threads_num = 1;
+
+	struct NodeLoadJobs jobs;
+	pthread_mutex_init(&jobs.lock, NULL);
+	jobs.items = (cJSON **)calloc(entries_num, sizeof(cJSON *));
+	jobs.first = (int *)calloc(entries_num, sizeof(int));
+	jobs.count = (int *)calloc(entries_num, sizeof(int));
+	jobs.num = entries_num;
+	jobs.next = 0;
+	jobs.results = (int *)calloc(entries_num, sizeof(int));
+	jobs.cache_hits = (bool *)calloc(entries_num, sizeof(bool));
+	jobs.load_ms = (double *)calloc(entries_num, sizeof(double));
+
+	int first = 0;
+	for (int i = 0; i < entries_num; ++i)
+	{
+		jobs.items[i] = cJSON_GetArrayItem(nodes_array, i);
+		jobs.first[i] = first;
+		jobs.count[i] = config_get_instance_num(jobs.items[i]);
+		first += jobs.count[i];
+	}
+
+	pthread_t *threads = (pthread_t *)malloc(threads_num * sizeof(pthread_t));
+	int started = 0;
+	for (int i = 1; i < threads_num; ++i)
+	{
+		if (pthread_create(&threads[started], NULL, config_load_worker, &jobs))
+			break;
+		++started;
+	}
+	// the main thread takes part in loading as well
+	config_load_worker(&jobs);
+	for (int i = 0; i < started; ++i)
+		pthread_join(threads[i], NULL);
+	free(threads);
+	pthread_mutex_destroy(&jobs.lock);
+
+	int err = RC_OK;
+	for (int i = 0; i < entries_num && RC_OK == err; ++i)
+	{
+		if (RC_OK != jobs.results[i])
+			err = RC_INIT;
+	}
+
+	// main chunks are executed in order, as they may
+	// interact with other nodes (e.g. via enable_node)
+	for (int i = 0; i < entries_num && RC_OK == err; ++i)
+	{
+		if (!jobs.count[i])
+			continue;
+		struct timespec run_start;
+		clock_gettime(CLOCK_MONOTONIC, &run_start);
+		for (int j = 0; j < jobs.count[i] && RC_OK == err; ++j)
+		{
+			if (RC_OK != config_run_node(&nodes[jobs.first[i] + j]))
+				err = RC_INIT;
+		}
+		double run_ms = config_elapsed_ms(&run_start);
+		if (jobs.count[i] > 1)
+			printf("template %s: %d instances loaded in %.3f ms (%s), initialized in %.3f ms\n",
+				cJSON_GetStringValue(cJSON_GetObjectItem(jobs.items[i], "name")),
+				jobs.count[i], jobs.load_ms[i],
+				jobs.cache_hits[i] ? "cached" : "compiled", run_ms);
+		else
+			printf("node %s: loaded in %.3f ms (%s), initialized in %.3f ms\n",
+				nodes[jobs.first[i]].name, jobs.load_ms[i],
+				jobs.cache_hits[i] ? "cached" : "compiled", run_ms);
+	}
+	if (RC_OK == err)
+		printf("%d node(s) ready in %.3f ms using %d thread(s)\n\n",
+			num, config_elapsed_ms(&start), started + 1);
+
+	free(jobs.load_ms);
+	free(jobs.cache_hits);
+	free(jobs.results);
+	free(jobs.count);
+	free(jobs.first);
+	free(jobs.items);
+	return err;
+}
+
+static void *config_load_worker(void *arg)
+{
+	struct NodeLoadJobs *jobs = (struct NodeLoadJobs *)arg;
+	while (1)
+	{
+		pthread_mutex_lock(&jobs->lock);
+		int idx = jobs->next++;
+		pthread_mutex_unlock(&jobs->lock);
+		if (idx >= jobs->num)
+			break;
+
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		int err = config_load_node(jobs->items[idx], jobs->first[idx], jobs->count[idx]);
+		jobs->load_ms[idx] = config_elapsed_ms(&start);
+		jobs->cache_hits[idx] = (RC_CACHED == err);
+		jobs->results[idx] = (RC_CACHED == err) ? RC_OK : err;
+	}
+	return NULL;
+}
+
+static double config_elapsed_ms(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e3 +
+		(now.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// tells whether remote nodes are enabled, either over a Unix socket or TCP
+bool config_get_remote(const char **path, int *port)
+{
+	cJSON *remote_item = cJSON_GetObjectItem(config, "remote");
+	if (!remote_item)
+		return false;
+	*path = cJSON_GetStringValue(cJSON_GetObjectItem(remote_item, "path"));
+	cJSON *port_item = cJSON_GetObjectItem(remote_item, "port");
+	*port = cJSON_IsNumber(port_item) ? (int)cJSON_GetNumberValue(port_item) : 0;
+	return *path || *port;
+}
+
+/*
+ * Defines system variables listed in the "sysvars" array, the store
+ * is exported as a shared memory object if "sysvar_shm" names one.
+ */
+int config_load_sysvars(void)
+{
+	cJSON *vars_array = cJSON_GetObjectItem(config, "sysvars");
+	int num = cJSON_GetArraySize(vars_array);
+	if (!num)
+		return RC_OK;
+
+	enum SysvarType *types = (enum SysvarType *)calloc(num, sizeof(enum SysvarType));
+	size_t *sizes = (size_t *)calloc(num, sizeof(size_t));
+	int err = RC_OK;
+	for (int i = 0; i < num && RC_OK == err; ++i)
+	{
+		cJSON *var_item = cJSON_GetArrayItem(vars_array, i);
+		const char *name = cJSON_GetStringValue(cJSON_GetObjectItem(var_item, "name"));
+		const char *type = cJSON_GetStringValue(cJSON_GetObjectItem(var_item, "type"));
+		cJSON *value_item = cJSON_GetObjectItem(var_item, "value");
+		sizes[i] = sizeof(lua_Integer);
+		if (!type || !strcmp(type, "int"))
+		{
+			types[i] = SV_INT;
+		}
+		else if (!strcmp(type, "float"))
+		{
+			types[i] = SV_FLOAT;
+		}
+		else if (!strcmp(type, "bytes"))
+		{
+			// the capacity defaults to the length of the initial value
+			types[i] = SV_BYTES;
+			size_t size;
+			if (!config_get_size(cJSON_GetObjectItem(var_item, "size"), &size))
+			{
+				fprintf(stderr, "sysvar %s: invalid size\n", name ? name : "?");
+				err = RC_CONFIGFILE;
+			}
+			sizes[i] = size;
+			if (!sizes[i] && cJSON_IsArray(value_item))
+				sizes[i] = cJSON_GetArraySize(value_item);
+			if (!sizes[i] && cJSON_IsString(value_item))
+				sizes[i] = strlen(cJSON_GetStringValue(value_item));
+		}
+		else
+		{
+			fprintf(stderr, "sysvar %s: unknown type %s\n", name ? name : "?", type);
+			err = RC_CONFIGFILE;
+		}
+
+		if (!name)
+		{
+			fprintf(stderr, "sysvar entry %d has no name\n", i);
+			err = RC_CONFIGFILE;
+		}
+		else if (!sizes[i] || sizes[i] > SYSVAR_BYTES_MAX)
+		{
+			fprintf(stderr, "sysvar %s: size must be between 1 and %d bytes\n", name, SYSVAR_BYTES_MAX);
+			err = RC_CONFIGFILE;
+		}
+	}
+
+	const char *shm_name = cJSON_GetStringValue(cJSON_GetObjectItem(config, "sysvar_shm"));
+	if (RC_OK == err)
+		err = sysvar_init(num, sizes, shm_name);
+
+	for (int i = 0; i < num && RC_OK == err; ++i)
+	{
+		cJSON *var_item = cJSON_GetArrayItem(vars_array, i);
+		const char *name = cJSON_GetStringValue(cJSON_GetObjectItem(var_item, "name"));
+		cJSON *value_item = cJSON_GetObjectItem(var_item, "value");
+		int var = sysvar_define(name, types[i], sizes[i]);
+		if (var < 0)
+		{
+			fprintf(stderr, "sysvar %s: duplicated name or longer than %d characters\n",
+				name, SYSVAR_NAME_MAX - 1);
+			err = RC_CONFIGFILE;
+		}
+		else if (SV_INT == types[i])
+		{
+			sysvar_set_int(var, config_get_integer(value_item, 0));
+		}
+		else if (SV_FLOAT == types[i])
+		{
+			sysvar_set_float(var, cJSON_IsNumber(value_item) ? cJSON_GetNumberValue(value_item) : 0.0);
+		}
+		else if (cJSON_IsString(value_item))
+		{
+			const char *value = cJSON_GetStringValue(value_item);
+			size_t len = strlen(value);
+			sysvar_set_bytes(var, value, len < sizes[i] ? len : sizes[i]);
+		}
+		else
+		{
+			// an array of bytes, like the payload of a message
+			unsigned char value[SYSVAR_BYTES_MAX];
+			int len = cJSON_GetArraySize(value_item);
+			if (len > (int)sizes[i])
+				len = sizes[i];
+			for (int j = 0; j < len; ++j)
+				value[j] = config_get_integer(cJSON_GetArrayItem(value_item, j), 0);
+			sysvar_set_bytes(var, value, len);
+		}
+	}
+
+	if (RC_OK == err)
+	{
+		if (shm_name)
+			printf("%d system variable(s) defined, exported as %s\n\n", num, shm_name);
+		else
+			printf("%d system variable(s) defined\n\n", num);
+	}
+	else
+	{
+		sysvar_deinit();
+	}
+	free(sizes);
+	free(types);
+	return err;
+}
+
+// path of a diagnostic database compiled by bulwa-diagc, NULL if none
+const char *config_get_diagdb_path(void)
+{
+	return cJSON_GetStringValue(cJSON_GetObjectItem(config, "diag_db"));
+}
+
+const char *config_get_profile_output(void)
+{
+	const char *path = cJSON_GetStringValue(cJSON_GetObjectItem(config, "profile_output"));
+	return path ? path : "bulwa.folded";
+}
+
+bool config_get_io_uring(void)
+{
+	return cJSON_IsTrue(cJSON_GetObjectItem(config, "io_uring"));
+}
+
 const char *config_get_canif_name(void)
 {
 	cJSON *canif_item = cJSON_GetObjectItem(config, "canif");
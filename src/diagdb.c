@@ -0,0 +1,356 @@
+/*
+	Bulwa CAN Simulator
+	Copyright (C) 2024 Szymon Morawski
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "global.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/*
+ * The database compiled by bulwa-diagc is mapped read only once
+ * and shared by all nodes, it is validated when opened so that
+ * lookups need no further checks.
+ */
+static const char *image = NULL;
+static size_t image_size = 0;
+static const struct DiagDbHeader *hdr = NULL;
+
+static const char *param_types[] = { "uint", "sint", "float", "ascii", "bytes", "bcd" };
+
+static bool diagdb_validate(void);
+static int diagdb_did(lua_State *lua);
+static int diagdb_service(lua_State *lua);
+static int diagdb_session(lua_State *lua);
+static int diagdb_dids(lua_State *lua);
+static int diagdb_services(lua_State *lua);
+static int diagdb_sessions(lua_State *lua);
+
+int diagdb_open(const char *path)
+{
+	diagdb_close();
+
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "cannot open diagnostic database %s\n", path);
+		return RC_CONFIGFILE;
+	}
+	struct stat st;
+	void *ptr = MAP_FAILED;
+	if (0 == fstat(fd, &st) && st.st_size >= (off_t)sizeof(struct DiagDbHeader))
+		ptr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (MAP_FAILED == ptr)
+	{
+		fprintf(stderr, "cannot map diagnostic database %s\n", path);
+		return RC_CONFIGFILE;
+	}
+
+	image = (const char *)ptr;
+	image_size = st.st_size;
+	hdr = (const struct DiagDbHeader *)image;
+	if (!diagdb_validate())
+	{
+		fprintf(stderr, "%s is not a valid diagnostic database, recompile it with bulwa-diagc\n", path);
+		diagdb_close();
+		return RC_CONFIGFILE;
+	}
+	return RC_OK;
+}
+
+void diagdb_close(void)
+{
+	if (image)
+		munmap((void *)image, image_size);
+	image = NULL;
+	image_size = 0;
+	hdr = NULL;
+}
+
+bool diagdb_loaded(void)
+{
+	return NULL != hdr;
+}
+
+const struct DiagDbDid *diagdb_find_did(uint16_t id)
+{
+	if (!hdr)
+		return NULL;
+	const struct DiagDbDid *dids = (const struct DiagDbDid *)(image + hdr->dids_offset);
+	const uint32_t *index = (const uint32_t *)(image + hdr->did_index_offset);
+	uint32_t idx = diagdb_hash(id, hdr->did_index_size);
+	while (index[idx])
+	{
+		if (id == dids[index[idx] - 1].id)
+			return &dids[index[idx] - 1];
+		idx = (idx + 1) & (hdr->did_index_size - 1);
+	}
+	return NULL;
+}
+
+const struct DiagDbService *diagdb_find_service(uint8_t sid)
+{
+	if (!hdr)
+		return NULL;
+	const uint16_t *index = (const uint16_t *)(image + hdr->service_index_offset);
+	if (!index[sid])
+		return NULL;
+	return (const struct DiagDbService *)(image + hdr->services_offset) + index[sid] - 1;
+}
+
+const struct DiagDbSession *diagdb_find_session(uint8_t id)
+{
+	if (!hdr)
+		return NULL;
+	const uint16_t *index = (const uint16_t *)(image + hdr->session_index_offset);
+	if (!index[id])
+		return NULL;
+	return (const struct DiagDbSession *)(image + hdr->sessions_offset) + index[id] - 1;
+}
+
+const char *diagdb_get_string(uint32_t offset)
+{
+	return image + hdr->strings_offset + offset;
+}
+
+void luaenv_add_diagdb_api(lua_State *lua)
+{
+	lua_newtable(lua);
+	lua_pushcfunction(lua, diagdb_did);
+	lua_setfield(lua, -2, "did");
+	lua_pushcfunction(lua, diagdb_service);
+	lua_setfield(lua, -2, "service");
+	lua_pushcfunction(lua, diagdb_session);
+	lua_setfield(lua, -2, "session");
+	lua_pushcfunction(lua, diagdb_dids);
+	lua_setfield(lua, -2, "dids");
+	lua_pushcfunction(lua, diagdb_services);
+	lua_setfield(lua, -2, "services");
+	lua_pushcfunction(lua, diagdb_sessions);
+	lua_setfield(lua, -2, "sessions");
+	lua_setglobal(lua, "diag_db");
+}
+
+static bool diagdb_section(uint32_t offset, uint64_t size)
+{
+	return 0 == offset % 8 && offset <= image_size && size <= image_size - offset;
+}
+
+static bool diagdb_validate(void)
+{
+	if (memcmp(hdr->magic, DIAGDB_MAGIC, sizeof(hdr->magic)) ||
+		DIAGDB_VERSION != hdr->version || image_size != hdr->size)
+		return false;
+	if (!hdr->did_index_size || (hdr->did_index_size & (hdr->did_index_size - 1)) ||
+		hdr->did_index_size < hdr->dids_num)
+		return false;
+	if (!diagdb_section(hdr->dids_offset, (uint64_t)hdr->dids_num * sizeof(struct DiagDbDid)) ||
+		!diagdb_section(hdr->did_index_offset, (uint64_t)hdr->did_index_size * sizeof(uint32_t)) ||
+		!diagdb_section(hdr->params_offset, (uint64_t)hdr->params_num * sizeof(struct DiagDbParam)) ||
+		!diagdb_section(hdr->services_offset, (uint64_t)hdr->services_num * sizeof(struct DiagDbService)) ||
+		!diagdb_section(hdr->service_index_offset, 256 * sizeof(uint16_t)) ||
+		!diagdb_section(hdr->subfunctions_offset, hdr->subfunctions_num) ||
+		!diagdb_section(hdr->sessions_offset, (uint64_t)hdr->sessions_num * sizeof(struct DiagDbSession)) ||
+		!diagdb_section(hdr->session_index_offset, 256 * sizeof(uint16_t)) ||
+		!diagdb_section(hdr->strings_offset, hdr->strings_size))
+		return false;
+	// every string must be terminated within the pool
+	if (!hdr->strings_size || image[hdr->strings_offset + hdr->strings_size - 1])
+		return false;
+
+	const struct DiagDbDid *dids = (const struct DiagDbDid *)(image + hdr->dids_offset);
+	const struct DiagDbParam *params = (const struct DiagDbParam *)(image + hdr->params_offset);
+	const struct DiagDbService *services = (const struct DiagDbService *)(image + hdr->services_offset);
+	const struct DiagDbSession *sessions = (const struct DiagDbSession *)(image + hdr->sessions_offset);
+	const uint32_t *did_index = (const uint32_t *)(image + hdr->did_index_offset);
+	const uint16_t *service_index = (const uint16_t *)(image + hdr->service_index_offset);
+	const uint16_t *session_index = (const uint16_t *)(image + hdr->session_index_offset);
+
+	for (uint32_t i = 0; i < hdr->dids_num; ++i)
+	{
+		if (dids[i].name >= hdr->strings_size || dids[i].first_param > hdr->params_num ||
+			dids[i].params_num > hdr->params_num - dids[i].first_param)
+			return false;
+	}
+	for (uint32_t i = 0; i < hdr->params_num; ++i)
+	{
+		if (params[i].name >= hdr->strings_size || params[i].unit >= hdr->strings_size ||
+			params[i].type > DP_BCD)
+			return false;
+	}
+	for (uint32_t i = 0; i < hdr->services_num; ++i)
+	{
+		if (services[i].name >= hdr->strings_size ||
+			services[i].first_subfunction > hdr->subfunctions_num ||
+			services[i].subfunctions_num > hdr->subfunctions_num - services[i].first_subfunction)
+			return false;
+	}
+	for (uint32_t i = 0; i < hdr->sessions_num; ++i)
+	{
+		if (sessions[i].name >= hdr->strings_size)
+			return false;
+	}
+	// an index with no empty slot would make lookups loop forever
+	bool empty_slot = false;
+	for (uint32_t i = 0; i < hdr->did_index_size; ++i)
+	{
+		if (did_index[i] > hdr->dids_num)
+			return false;
+		empty_slot = empty_slot || !did_index[i];
+	}
+	for (int i = 0; i < 256; ++i)
+	{
+		if (service_index[i] > hdr->services_num || session_index[i] > hdr->sessions_num)
+			return false;
+	}
+	return empty_slot;
+}
+
+// returns the description of a DID, nil if there is no such DID
+static int diagdb_did(lua_State *lua)
+{
+	lua_Integer id = luaL_checkinteger(lua, 1);
+	const struct DiagDbDid *did = (id >= 0 && id <= 0xffff) ? diagdb_find_did(id) : NULL;
+	if (!did)
+	{
+		lua_pushnil(lua);
+		return 1;
+	}
+
+	lua_createtable(lua, 0, 6);
+	lua_pushinteger(lua, did->id);
+	lua_setfield(lua, -2, "id");
+	lua_pushstring(lua, diagdb_get_string(did->name));
+	lua_setfield(lua, -2, "name");
+	lua_pushinteger(lua, did->length);
+	lua_setfield(lua, -2, "length");
+	lua_pushboolean(lua, did->flags & DIAGDB_READ);
+	lua_setfield(lua, -2, "read");
+	lua_pushboolean(lua, did->flags & DIAGDB_WRITE);
+	lua_setfield(lua, -2, "write");
+
+	const struct DiagDbParam *params = (const struct DiagDbParam *)(image + hdr->params_offset);
+	lua_createtable(lua, did->params_num, 0);
+	for (uint32_t i = 0; i < did->params_num; ++i)
+	{
+		const struct DiagDbParam *param = &params[did->first_param + i];
+		lua_createtable(lua, 0, 8);
+		lua_pushstring(lua, diagdb_get_string(param->name));
+		lua_setfield(lua, -2, "name");
+		lua_pushstring(lua, param_types[param->type]);
+		lua_setfield(lua, -2, "type");
+		lua_pushinteger(lua, param->byte_pos);
+		lua_setfield(lua, -2, "byte");
+		lua_pushinteger(lua, param->bit_pos);
+		lua_setfield(lua, -2, "bit");
+		lua_pushinteger(lua, param->bit_length);
+		lua_setfield(lua, -2, "bits");
+		lua_pushnumber(lua, param->factor);
+		lua_setfield(lua, -2, "factor");
+		lua_pushnumber(lua, param->offset);
+		lua_setfield(lua, -2, "offset");
+		lua_pushstring(lua, diagdb_get_string(param->unit));
+		lua_setfield(lua, -2, "unit");
+		lua_rawseti(lua, -2, i + 1);
+	}
+	lua_setfield(lua, -2, "params");
+	return 1;
+}
+
+static int diagdb_service(lua_State *lua)
+{
+	lua_Integer sid = luaL_checkinteger(lua, 1);
+	const struct DiagDbService *service = (sid >= 0 && sid <= 0xff) ? diagdb_find_service(sid) : NULL;
+	if (!service)
+	{
+		lua_pushnil(lua);
+		return 1;
+	}
+
+	lua_createtable(lua, 0, 3);
+	lua_pushinteger(lua, service->sid);
+	lua_setfield(lua, -2, "sid");
+	lua_pushstring(lua, diagdb_get_string(service->name));
+	lua_setfield(lua, -2, "name");
+	const uint8_t *subfunctions = (const uint8_t *)(image + hdr->subfunctions_offset) +
+		service->first_subfunction;
+	lua_createtable(lua, service->subfunctions_num, 0);
+	for (uint32_t i = 0; i < service->subfunctions_num; ++i)
+	{
+		lua_pushinteger(lua, subfunctions[i]);
+		lua_rawseti(lua, -2, i + 1);
+	}
+	lua_setfield(lua, -2, "subfunctions");
+	return 1;
+}
+
+static int diagdb_session(lua_State *lua)
+{
+	lua_Integer id = luaL_checkinteger(lua, 1);
+	const struct DiagDbSession *session = (id >= 0 && id <= 0xff) ? diagdb_find_session(id) : NULL;
+	if (!session)
+	{
+		lua_pushnil(lua);
+		return 1;
+	}
+
+	lua_createtable(lua, 0, 2);
+	lua_pushinteger(lua, session->id);
+	lua_setfield(lua, -2, "id");
+	lua_pushstring(lua, diagdb_get_string(session->name));
+	lua_setfield(lua, -2, "name");
+	return 1;
+}
+
+// identifiers of all DIDs in ascending order
+static int diagdb_dids(lua_State *lua)
+{
+	const struct DiagDbDid *dids = (const struct DiagDbDid *)(image + hdr->dids_offset);
+	lua_createtable(lua, hdr->dids_num, 0);
+	for (uint32_t i = 0; i < hdr->dids_num; ++i)
+	{
+		lua_pushinteger(lua, dids[i].id);
+		lua_rawseti(lua, -2, i + 1);
+	}
+	return 1;
+}
+
+static int diagdb_services(lua_State *lua)
+{
+	const struct DiagDbService *services = (const struct DiagDbService *)(image + hdr->services_offset);
+	lua_createtable(lua, hdr->services_num, 0);
+	for (uint32_t i = 0; i < hdr->services_num; ++i)
+	{
+		lua_pushinteger(lua, services[i].sid);
+		lua_rawseti(lua, -2, i + 1);
+	}
+	return 1;
+}
+
+static int diagdb_sessions(lua_State *lua)
+{
+	const struct DiagDbSession *sessions = (const struct DiagDbSession *)(image + hdr->sessions_offset);
+	lua_createtable(lua, hdr->sessions_num, 0);
+	for (uint32_t i = 0; i < hdr->sessions_num; ++i)
+	{
+		lua_pushinteger(lua, sessions[i].id);
+		lua_rawseti(lua, -2, i + 1);
+	}
+	return 1;
+}
@@ -0,0 +1,122 @@
+/*
+	Bulwa CAN Simulator
+	Copyright (C) 2024 Szymon Morawski
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#ifndef _H_DIAGDB
+#define _H_DIAGDB
+
+#include <stdint.h>
+
+/*
+ * Layout of a diagnostic database compiled by bulwa-diagc, shared
+ * by the compiler and the loader. All sections are 8 byte aligned
+ * and referenced by offsets from the start of the file, integers
+ * are in host byte order. Strings are offsets into the string pool,
+ * 0 being the empty string.
+ *
+ * DIDs are sorted by identifier and indexed by an open addressing
+ * hash table of did_index_size slots (a power of two), each slot
+ * holding the index of a DID plus one, or 0 if empty. Services and
+ * sessions are indexed by tables of 256 slots of the same kind.
+ */
+#define DIAGDB_MAGIC		"BLWD"
+#define DIAGDB_VERSION		1
+
+enum DiagDbParamType
+{
+	DP_UINT,
+	DP_SINT,
+	DP_FLOAT,
+	DP_ASCII,
+	DP_BYTES,
+	DP_BCD
+};
+
+#define DIAGDB_READ		0x01
+#define DIAGDB_WRITE		0x02
+
+struct DiagDbHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t size;
+	uint32_t dids_num;
+	uint32_t dids_offset;
+	uint32_t did_index_size;
+	uint32_t did_index_offset;
+	uint32_t params_num;
+	uint32_t params_offset;
+	uint32_t services_num;
+	uint32_t services_offset;
+	uint32_t service_index_offset;
+	uint32_t subfunctions_num;
+	uint32_t subfunctions_offset;
+	uint32_t sessions_num;
+	uint32_t sessions_offset;
+	uint32_t session_index_offset;
+	uint32_t strings_size;
+	uint32_t strings_offset;
+	uint32_t reserved;
+};
+
+struct DiagDbDid
+{
+	uint16_t id;
+	uint16_t flags;
+	uint32_t name;
+	uint32_t length;		// bytes of data following the identifier
+	uint32_t first_param;
+	uint32_t params_num;
+	uint32_t reserved;
+};
+
+struct DiagDbParam
+{
+	uint32_t name;
+	uint32_t unit;
+	uint32_t byte_pos;		// relative to the first byte of data
+	uint16_t bit_pos;
+	uint16_t type;
+	uint32_t bit_length;
+	uint32_t reserved;
+	double factor;			// physical value = raw * factor + offset
+	double offset;
+};
+
+struct DiagDbService
+{
+	uint8_t sid;
+	uint8_t reserved[3];
+	uint32_t name;
+	uint32_t first_subfunction;	// index into an array of uint8_t
+	uint32_t subfunctions_num;
+};
+
+struct DiagDbSession
+{
+	uint8_t id;
+	uint8_t reserved[3];
+	uint32_t name;
+};
+
+static inline uint32_t diagdb_hash(uint16_t id, uint32_t size)
+{
+	uint32_t h = id * 2654435761u;
+	return (h ^ (h >> 16)) & (size - 1);
+}
+
+#endif
@@ -0,0 +1,81 @@
+/*
+	Bulwa CAN Simulator
+	Copyright (C) 2024 Szymon Morawski
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "global.h"
+
+#ifdef BULWA_LUAJIT
+
+#define FFI_RX_FRAME_KEY "bulwa.rx_frame"
+
+/*
+ * Declares struct canfd_frame for the FFI, wraps emit so that
+ * it accepts cdata and returns a pointer to the receive buffer.
+ * For classic CAN frames the flags field is padding and len8_dlc
+ * carries the optional DLC, as in struct can_frame.
+ */
+static const char ffi_prelude[] =
+	"local ffi = require('ffi')\n"
+	"ffi.cdef[[\n"
+	"struct canfd_frame {\n"
+	"	uint32_t can_id;\n"
+	"	uint8_t len;\n"
+	"	uint8_t flags;\n"
+	"	uint8_t __res0;\n"
+	"	uint8_t len8_dlc;\n"
+	"	uint8_t data[64] __attribute__((aligned(8)));\n"
+	"};\n"
+	"const struct canfd_frame *bulwa_rx_frame(void);\n"
+	"int bulwa_emit_frame(const struct canfd_frame *frame, int mtu);\n"
+	"]]\n"
+	"local C = ffi.C\n"
+	"local emit_table = emit\n"
+	"can_frame = ffi.typeof('struct canfd_frame')\n"
+	"function emit(msg, mtu)\n"
+	"	if type(msg) == 'cdata' then\n"
+	"		mtu = mtu or ((msg.len > 8) and 72 or 16)\n"
+	"		return C.bulwa_emit_frame(msg, mtu)\n"
+	"	end\n"
+	"	return emit_table(msg)\n"
+	"end\n"
+	"return C.bulwa_rx_frame()\n";
+
+int luaenv_add_ffi_api(lua_State *lua)
+{
+	if (luaL_loadbuffer(lua, ffi_prelude, sizeof(ffi_prelude) - 1, "=ffi") ||
+		lua_pcall(lua, 0, 1, 0))
+	{
+		fprintf(stderr, "ffi: %s\n", lua_tostring(lua, -1));
+		lua_pop(lua, 1);
+		return RC_INIT;
+	}
+	lua_setfield(lua, LUA_REGISTRYINDEX, FFI_RX_FRAME_KEY);
+	return RC_OK;
+}
+
+int luaenv_push_rx_frame(lua_State *lua)
+{
+	lua_getfield(lua, LUA_REGISTRYINDEX, FFI_RX_FRAME_KEY);
+	return lua_type(lua, -1);
+}
+
+const struct canfd_frame *bulwa_rx_frame(void)
+{
+	return &rx_frame;
+}
+
+#endif
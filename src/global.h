@@ -23,10 +23,12 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stdint.h>
 
 #include <unistd.h>
 
 #include <net/if.h>
+#include <poll.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 
@@ -35,10 +37,28 @@
 #include <linux/net_tstamp.h>
 #include <linux/can/error.h>
 
+#include "diagdb.h"
+
 #include <lua.h>
 #include <lauxlib.h>
 #include <lualib.h>
 
+#ifdef BULWA_LUAJIT
+#include <luajit.h>
+
+/* LuaJIT implements the Lua 5.1 API, fill in the parts
+ * of the newer API the simulator relies on
+ */
+#undef lua_getglobal
+#define lua_getglobal(L, name)	(lua_getfield((L), LUA_GLOBALSINDEX, (name)), lua_type((L), -1))
+#define lua_len(L, idx)		lua_pushinteger((L), (lua_Integer)lua_objlen((L), (idx)))
+#define lua_dump(L, writer, data, strip)	lua_dump((L), (writer), (data))
+#define lua_pushglobaltable(L)	lua_pushvalue((L), LUA_GLOBALSINDEX)
+#define BULWA_LUA_RELEASE	LUAJIT_VERSION
+#else
+#define BULWA_LUA_RELEASE	LUA_RELEASE
+#endif
+
 enum ReturnCode
 {
 	RC_OK,
@@ -49,32 +69,185 @@ enum ReturnCode
 	RC_SOCKET,
 	RC_BIND,
 	RC_SOCKETREAD,
+	RC_CACHED,
+	RC_MEMORY,
+	RC_BUDGET,
 	RC_END
 };
 
+enum SysvarType
+{
+	SV_INT,
+	SV_FLOAT,
+	SV_BYTES
+};
+
+#define J1939_MAX_SIZE		1785
+#define J1939_NULL_ADDRESS	254
+
+#define SYSVAR_NAME_MAX		64
+#define SYSVAR_BYTES_MAX	4096
+
+#define PROFILER_DEFAULT_PERIOD	1000	// microseconds
+#define NODE_HOOK_COUNT		1000	// instructions between checks of the count hook
+
+struct LuaAllocator;
+struct Profile;
+struct Budget;
+
 struct ScriptNode
 {
 	char *name;
 	lua_State *lua;
+	bool owns_lua;		// false for instances sharing the state of a template
+	struct LuaAllocator *alloc;	// shared by instances as well, NULL if not used
+	int instance;		// index within a template, 0 for standalone nodes
+	int env_ref;		// registry references, LUA_NOREF for standalone nodes
+	int chunk_ref;
 	bool enabled;
 	lua_Integer timer_interval;
 	timer_t timerid;
+	struct Profile *profile;	// NULL unless the node has been profiled
+	struct Budget *budget;		// NULL if callbacks are not limited
+	const char *callback;		// looked up by node_getglobal, consumed by node_pcall
 };
 
 extern int s;
+extern struct canfd_frame rx_frame;
 extern struct ScriptNode *nodes;
 extern int nodes_num;
+extern struct ScriptNode *running_node;
+
+void luaenv_add_custom_api(lua_State *lua);
+void luaenv_add_node_api(lua_State *lua, int node_id);
+void luaenv_push_instance_env(lua_State *lua);
+void luaenv_set_chunk_env(lua_State *lua, int idx);
+int bulwa_emit_frame(const struct canfd_frame *frame, int mtu);
+void luaenv_push_sysvar(lua_State *lua, int var);
+void luaenv_add_diagdb_api(lua_State *lua);
+
+#ifdef BULWA_LUAJIT
+int luaenv_add_ffi_api(lua_State *lua);
+int luaenv_push_rx_frame(lua_State *lua);
+const struct canfd_frame *bulwa_rx_frame(void);
+#endif
 
-void luaenv_add_custom_api(lua_State *lua, int node_id);
-
+int node_getglobal(struct ScriptNode *node, const char *name);
+int node_pcall(struct ScriptNode *node, int nargs, int nresults);
+int node_report_error(struct ScriptNode *node, int err);
+void node_update_hook(struct ScriptNode *node);
 void node_enable(struct ScriptNode *node);
 void node_disable(struct ScriptNode *node);
 void node_set_timer(struct ScriptNode *node, lua_Integer interval);
+int node_onpgn(struct ScriptNode *node, uint32_t pgn, uint8_t priority, uint8_t sa,
+	uint8_t da, const uint8_t *data, int len, unsigned long long int timestamp);
+int node_onaddressclaimed(struct ScriptNode *node, uint8_t address);
 
 int config_load(const char *path);
 int config_get_node_num(void);
-int config_load_node(int idx, struct ScriptNode *node);
+int config_load_nodes(struct ScriptNode *nodes, int num);
 void config_unload(void);
 const char *config_get_canif_name(void);
+bool config_get_remote(const char **path, int *port);
+int config_load_sysvars(void);
+const char *config_get_diagdb_path(void);
+const char *config_get_profile_output(void);
+bool config_get_io_uring(void);
+
+#define REMOTE_MAX_CLIENTS	32
+#define REMOTE_MAX_POLLFDS	(1 + REMOTE_MAX_CLIENTS)
+
+int remote_init(const char *path, int port);
+void remote_deinit(void);
+bool remote_enabled(void);
+int remote_get_pollfds(struct pollfd *fds, int max);
+void remote_process(const struct pollfd *fds, int num);
+void remote_onmessage(const struct canfd_frame *frame, int mtu,
+	unsigned long long int timestamp);
+void remote_flush(void);
+
+// room for control messages of a received frame (timestamps)
+#define RX_CONTROL_SIZE		(CMSG_SPACE(sizeof(struct timeval)) + \
+	CMSG_SPACE(3 * sizeof(struct timespec)))
+
+int uring_init(int fd);
+void uring_deinit(void);
+bool uring_active(void);
+int uring_wait(struct pollfd *fds, int num, int timeout);
+int uring_recvmsg(struct msghdr *msg);
+int uring_emit(const struct canfd_frame *frame, int mtu);
+
+struct LuaAllocator *alloc_create(size_t limit);
+void alloc_destroy(struct LuaAllocator *alloc);
+lua_State *alloc_newstate(struct LuaAllocator *alloc);
+void alloc_get_stats(const struct LuaAllocator *alloc, size_t *live, size_t *peak, size_t *limit);
+bool alloc_enforce(struct LuaAllocator *alloc, bool enforced);
+bool alloc_limit_hit(struct LuaAllocator *alloc);
+
+int sysvar_init(int num, const size_t *sizes, const char *name);
+void sysvar_deinit(void);
+int sysvar_define(const char *name, enum SysvarType type, size_t capacity);
+int sysvar_find(const char *name);
+bool sysvar_valid(int var);
+const char *sysvar_get_name(int var);
+enum SysvarType sysvar_get_type(int var);
+size_t sysvar_get_capacity(int var);
+lua_Integer sysvar_get_int(int var);
+lua_Number sysvar_get_float(int var);
+size_t sysvar_get_bytes(int var, void *value);
+void sysvar_set_int(int var, lua_Integer value);
+void sysvar_set_float(int var, lua_Number value);
+void sysvar_set_bytes(int var, const void *value, size_t length);
+int sysvar_subscribe(int var, int node_id);
+const int *sysvar_get_subscribers(int var, int *num);
+const int *sysvar_get_changes(int *num);
+bool sysvar_changes_pending(void);
+
+int diagdb_open(const char *path);
+void diagdb_close(void);
+bool diagdb_loaded(void);
+const struct DiagDbDid *diagdb_find_did(uint16_t id);
+const struct DiagDbService *diagdb_find_service(uint8_t sid);
+const struct DiagDbSession *diagdb_find_session(uint8_t id);
+const char *diagdb_get_string(uint32_t offset);
+
+int j1939_init(int num);
+void j1939_deinit(void);
+int j1939_claim(int node_id, uint8_t address, uint64_t name, bool has_name);
+int j1939_subscribe(int node_id, int32_t pgn);
+int j1939_send(int node_id, uint32_t pgn, uint8_t priority, uint8_t da,
+	const uint8_t *data, int len);
+void j1939_onmessage(const struct canfd_frame *frame, int mtu,
+	unsigned long long int timestamp);
+void j1939_process(void);
+int j1939_get_timeout(int timeout);
+
+void profiler_init(const char *path);
+void profiler_deinit(void);
+int profiler_start(struct ScriptNode *node, unsigned long long period_us);
+void profiler_stop(struct ScriptNode *node);
+bool profiler_active(const struct ScriptNode *node);
+void profiler_hook(struct ScriptNode *node, lua_State *lua);
+void profiler_lookup(struct ScriptNode *node, const char *name);
+int profiler_call_begin(struct ScriptNode *node);
+void profiler_call_end(struct ScriptNode *node, int token);
+
+struct Budget *budget_create(unsigned long long instructions, unsigned long long time_us,
+	int quarantine);
+void budget_destroy(struct Budget *budget);
+int budget_get_hook_count(const struct Budget *budget);
+void budget_begin(struct Budget *budget, const char *callback);
+bool budget_end(struct Budget *budget);
+bool budget_hook(struct Budget *budget);
+const char *budget_get_message(const struct Budget *budget);
+bool budget_exceeded(const struct Budget *budget);
+bool budget_quarantine(const struct Budget *budget);
+void budget_reset(struct Budget *budget);
+void budget_get_stats(const struct Budget *budget, unsigned long long *overruns,
+	unsigned long long *longest_us);
+
+int bccache_init(const char *config_path);
+void bccache_deinit(void);
+int bccache_load(lua_State *lua, const char *script_path, bool *hit);
 
 #endif
@@ -0,0 +1,854 @@
+/*
+	Bulwa CAN Simulator
+	Copyright (C) 2024 Szymon Morawski
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "global.h"
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * SAE J1939 network and transport layers on top of the raw socket,
+ * so that any number of simulated controllers share a single socket.
+ * Frames sent by nodes come back through the socket (see
+ * CAN_RAW_RECV_OWN_MSGS), which is how nodes talk to each other.
+ */
+#define PGN_REQUEST		0x0EA00
+#define PGN_TP_DT		0x0EB00
+#define PGN_TP_CM		0x0EC00
+#define PGN_ADDRESS_CLAIMED	0x0EE00
+
+#define TP_CM_RTS		16
+#define TP_CM_CTS		17
+#define TP_CM_EOMA		19
+#define TP_CM_BAM		32
+#define TP_CM_ABORT		255
+
+#define TP_ABORT_RESOURCES	2
+#define TP_ABORT_TIMEOUT	3
+
+// timing in milliseconds, see J1939-21 and J1939-81
+#define TP_BAM_INTERVAL		50
+#define TP_T1			750
+#define TP_T2			1250
+#define TP_T3			1250
+#define TP_T4			1050
+#define CLAIM_TIMEOUT		250
+
+#define TP_PRIORITY		7
+#define CLAIM_PRIORITY		6
+#define ARBITRARY_FIRST		128
+#define ARBITRARY_LAST		247
+
+enum J1939ClaimState
+{
+	CLAIM_NONE,		// no address, the node only listens
+	CLAIM_FIXED,		// address used without claiming it
+	CLAIM_PENDING,
+	CLAIM_DONE,
+	CLAIM_LOST
+};
+
+struct J1939Node
+{
+	enum J1939ClaimState state;
+	uint8_t address;
+	uint64_t name;
+	uint64_t deadline;
+};
+
+enum J1939SessionType
+{
+	TP_TX_BAM,
+	TP_TX_CMDT,
+	TP_RX_BAM,
+	TP_RX_CMDT
+};
+
+struct J1939Session
+{
+	enum J1939SessionType type;
+	int node;		// sending or receiving node, -1 for broadcasts received
+	uint8_t sa;
+	uint8_t da;
+	uint8_t priority;
+	uint32_t pgn;
+	uint8_t *data;
+	int size;
+	int packets;
+	int next;		// sequence number of the next packet
+	int window_end;		// last packet allowed by the CTS being served
+	int max_per_cts;
+	bool announced;		// RTS or BAM sent
+	uint64_t deadline;
+};
+
+// subscribers of a PGN, kept in an open addressing hash table
+struct J1939PgnEntry
+{
+	uint32_t pgn;
+	bool used;
+	int *nodes;
+	int nodes_num;
+};
+
+static struct J1939Node *j1939_nodes = NULL;
+static int j1939_nodes_num = 0;
+static struct J1939PgnEntry *pgn_table = NULL;
+static unsigned int pgn_table_size = 0;
+static unsigned int pgn_table_used = 0;
+static int *any_pgn_nodes = NULL;	// subscribers of all PGNs
+static int any_pgn_nodes_num = 0;
+static struct J1939Session *sessions = NULL;
+static int sessions_num = 0;
+static int sessions_cap = 0;
+static bool foreign_used[256];		// claimed by controllers outside the simulator
+
+static uint64_t j1939_now(void);
+static void j1939_emit(uint32_t pgn, uint8_t priority, uint8_t sa, uint8_t da,
+	const uint8_t *data, int len);
+static void j1939_emit_claim(struct J1939Node *jnode);
+static void j1939_emit_cm(uint8_t sa, uint8_t da, uint8_t control,
+	uint8_t b1, uint8_t b2, uint8_t b3, uint8_t b4, uint32_t pgn);
+static void j1939_deliver(uint32_t pgn, uint8_t priority, uint8_t sa, uint8_t da,
+	const uint8_t *data, int len, unsigned long long int timestamp);
+static void j1939_onclaim(uint8_t sa, uint64_t name);
+static void j1939_onrequest(uint8_t da, uint32_t pgn);
+static void j1939_oncm(uint8_t sa, uint8_t da, const uint8_t *data);
+static void j1939_ondt(uint8_t sa, uint8_t da, const uint8_t *data,
+	unsigned long long int timestamp);
+static void j1939_send_packets(struct J1939Session *session, int last);
+static void j1939_send_cts(struct J1939Session *session);
+static bool j1939_claim_next(int node_id);
+static int j1939_find_node(uint8_t address);
+static struct J1939Session *j1939_find_session(enum J1939SessionType type,
+	uint8_t sa, uint8_t da);
+static struct J1939Session *j1939_new_session(void);
+static void j1939_close_session(struct J1939Session *session);
+static struct J1939PgnEntry *j1939_lookup(uint32_t pgn, bool insert);
+static bool j1939_add_subscriber(int **list, int *num, int node_id);
+
+// PDU1 PGNs have the low byte clear, so mix the bits before masking
+static inline unsigned int j1939_hash(uint32_t pgn, unsigned int size)
+{
+	uint32_t h = pgn * 2654435761u;
+	return (h ^ (h >> 16)) & (size - 1);
+}
+
+static inline uint32_t j1939_get_pgn(const uint8_t *data)
+{
+	return data[0] | (data[1] << 8) | ((data[2] & 0x03) << 16);
+}
+
+int j1939_init(int num)
+{
+	j1939_deinit();
+	j1939_nodes = (struct J1939Node *)calloc(num ? num : 1, sizeof(struct J1939Node));
+	j1939_nodes_num = num;
+	pgn_table_size = 64;
+	pgn_table = (struct J1939PgnEntry *)calloc(pgn_table_size, sizeof(struct J1939PgnEntry));
+	if (!j1939_nodes || !pgn_table)
+		return RC_MEMORY;
+	return RC_OK;
+}
+
+void j1939_deinit(void)
+{
+	for (unsigned int i = 0; i < pgn_table_size; ++i)
+		free(pgn_table[i].nodes);
+	free(pgn_table);
+	pgn_table = NULL;
+	pgn_table_size = 0;
+	pgn_table_used = 0;
+	free(any_pgn_nodes);
+	any_pgn_nodes = NULL;
+	any_pgn_nodes_num = 0;
+	for (int i = 0; i < sessions_num; ++i)
+		free(sessions[i].data);
+	free(sessions);
+	sessions = NULL;
+	sessions_num = 0;
+	sessions_cap = 0;
+	free(j1939_nodes);
+	j1939_nodes = NULL;
+	j1939_nodes_num = 0;
+	memset(foreign_used, 0, sizeof(foreign_used));
+}
+
+/*
+ * Starts claiming an address with a given NAME, the result is passed
+ * to on_address_claimed. Without a NAME the address is used as is.
+ */
+int j1939_claim(int node_id, uint8_t address, uint64_t name, bool has_name)
+{
+	if (address > 253)
+		return RC_CALL;
+	struct J1939Node *jnode = &j1939_nodes[node_id];
+	jnode->address = address;
+	jnode->name = name;
+	if (!has_name)
+	{
+		jnode->state = CLAIM_FIXED;
+		return RC_OK;
+	}
+	jnode->state = CLAIM_PENDING;
+	jnode->deadline = j1939_now() + CLAIM_TIMEOUT;
+	j1939_emit_claim(jnode);
+	return RC_OK;
+}
+
+// pgn < 0 subscribes to all PGNs
+int j1939_subscribe(int node_id, int32_t pgn)
+{
+	if (pgn < 0)
+		return j1939_add_subscriber(&any_pgn_nodes, &any_pgn_nodes_num, node_id) ? RC_OK : RC_MEMORY;
+	struct J1939PgnEntry *entry = j1939_lookup(pgn, true);
+	if (!entry || !j1939_add_subscriber(&entry->nodes, &entry->nodes_num, node_id))
+		return RC_MEMORY;
+	return RC_OK;
+}
+
+/*
+ * Sends a message from the address of a node, messages longer than
+ * 8 bytes are sent with BAM if addressed globally, otherwise with
+ * RTS/CTS. Returns RC_CALL if the node has no address to send from
+ * or a transfer to the same destination is in progress.
+ */
+int j1939_send(int node_id, uint32_t pgn, uint8_t priority, uint8_t da,
+	const uint8_t *data, int len)
+{
+	struct J1939Node *jnode = &j1939_nodes[node_id];
+	if (CLAIM_FIXED != jnode->state && CLAIM_DONE != jnode->state)
+		return RC_CALL;
+	if (len < 0 || len > J1939_MAX_SIZE)
+		return RC_CALL;
+	// PDU2 messages are always broadcast
+	if (((pgn >> 8) & 0xff) >= 240)
+		da = 0xff;
+
+	if (len <= 8)
+	{
+		j1939_emit(pgn, priority, jnode->address, da, data, len);
+		return RC_OK;
+	}
+
+	enum J1939SessionType type = (0xff == da) ? TP_TX_BAM : TP_TX_CMDT;
+	if (j1939_find_session(type, jnode->address, da))
+		return RC_CALL;
+	struct J1939Session *session = j1939_new_session();
+	if (!session)
+		return RC_MEMORY;
+	session->data = (uint8_t *)malloc(len);
+	if (!session->data)
+	{
+		j1939_close_session(session);
+		return RC_MEMORY;
+	}
+	memcpy(session->data, data, len);
+	session->type = type;
+	session->node = node_id;
+	session->sa = jnode->address;
+	session->da = da;
+	session->priority = priority;
+	session->pgn = pgn;
+	session->size = len;
+	session->packets = (len + 6) / 7;
+	session->next = 1;
+	// the announcement goes out with the next call to j1939_process
+	session->deadline = 0;
+	return RC_OK;
+}
+
+void j1939_onmessage(const struct canfd_frame *frame, int mtu,
+	unsigned long long int timestamp)
+{
+	if (CAN_MTU != mtu || !(frame->can_id & CAN_EFF_FLAG) ||
+		(frame->can_id & (CAN_RTR_FLAG | CAN_ERR_FLAG)))
+		return;
+
+	canid_t id = frame->can_id & CAN_EFF_MASK;
+	uint8_t priority = (id >> 26) & 0x07;
+	uint8_t pf = (id >> 16) & 0xff;
+	uint8_t sa = id & 0xff;
+	uint8_t da = 0xff;
+	uint32_t pgn = (id >> 8) & 0x3ffff;
+	if (pf < 240)
+	{
+		da = pgn & 0xff;
+		pgn &= 0x3ff00;
+	}
+
+	switch (pgn)
+	{
+	case PGN_ADDRESS_CLAIMED:
+		if (8 == frame->len)
+		{
+			uint64_t name = 0;
+			for (int i = 7; i >= 0; --i)
+				name = (name << 8) | frame->data[i];
+			j1939_onclaim(sa, name);
+		}
+		break;
+	case PGN_REQUEST:
+		if (frame->len >= 3)
+			j1939_onrequest(da, j1939_get_pgn(frame->data));
+		break;
+	case PGN_TP_CM:
+		if (8 == frame->len)
+			j1939_oncm(sa, da, frame->data);
+		break;
+	case PGN_TP_DT:
+		if (8 == frame->len)
+			j1939_ondt(sa, da, frame->data, timestamp);
+		break;
+	}
+
+	j1939_deliver(pgn, priority, sa, da, frame->data, frame->len, timestamp);
+}
+
+// runs timeouts of address claims and transport sessions
+void j1939_process(void)
+{
+	uint64_t now = j1939_now();
+
+	for (int i = 0; i < j1939_nodes_num; ++i)
+	{
+		struct J1939Node *jnode = &j1939_nodes[i];
+		if (CLAIM_PENDING == jnode->state && now >= jnode->deadline)
+		{
+			jnode->state = CLAIM_DONE;
+			if (nodes[i].enabled)
+				node_onaddressclaimed(&nodes[i], jnode->address);
+		}
+	}
+
+	// iterate backwards, as sessions are removed by swapping with the last one
+	for (int i = sessions_num - 1; i >= 0; --i)
+	{
+		struct J1939Session *session = &sessions[i];
+		if (now < session->deadline)
+			continue;
+		if (session->node >= 0 && !nodes[session->node].enabled)
+		{
+			j1939_close_session(session);
+			continue;
+		}
+
+		switch (session->type)
+		{
+		case TP_TX_BAM:
+			if (!session->announced)
+			{
+				j1939_emit_cm(session->sa, 0xff, TP_CM_BAM, session->size & 0xff,
+					session->size >> 8, session->packets, 0xff, session->pgn);
+				session->announced = true;
+				session->deadline = now + TP_BAM_INTERVAL;
+			}
+			else
+			{
+				j1939_send_packets(session, session->next);
+				if (session->next > session->packets)
+					j1939_close_session(session);
+				else
+					session->deadline = now + TP_BAM_INTERVAL;
+			}
+			break;
+		case TP_TX_CMDT:
+			if (!session->announced)
+			{
+				j1939_emit_cm(session->sa, session->da, TP_CM_RTS, session->size & 0xff,
+					session->size >> 8, session->packets, 0xff, session->pgn);
+				session->announced = true;
+				session->deadline = now + TP_T3;
+			}
+			else
+			{
+				fprintf(stderr, "warning: %s: J1939 transfer of PGN %05x to %02x timed out\n",
+					nodes[session->node].name, session->pgn, session->da);
+				j1939_emit_cm(session->sa, session->da, TP_CM_ABORT, TP_ABORT_TIMEOUT,
+					0xff, 0xff, 0xff, session->pgn);
+				j1939_close_session(session);
+			}
+			break;
+		case TP_RX_CMDT:
+			j1939_emit_cm(session->da, session->sa, TP_CM_ABORT, TP_ABORT_TIMEOUT,
+				0xff, 0xff, 0xff, session->pgn);
+			j1939_close_session(session);
+			break;
+		case TP_RX_BAM:
+			j1939_close_session(session);
+			break;
+		}
+	}
+}
+
+// shortens the timeout of poll so that the nearest deadline is kept
+int j1939_get_timeout(int timeout)
+{
+	uint64_t now = j1939_now();
+	uint64_t nearest = now + timeout;
+	for (int i = 0; i < j1939_nodes_num; ++i)
+	{
+		if (CLAIM_PENDING == j1939_nodes[i].state && j1939_nodes[i].deadline < nearest)
+			nearest = j1939_nodes[i].deadline;
+	}
+	for (int i = 0; i < sessions_num; ++i)
+	{
+		if (sessions[i].deadline < nearest)
+			nearest = sessions[i].deadline;
+	}
+	return nearest > now ? (int)(nearest - now) : 0;
+}
+
+static uint64_t j1939_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void j1939_emit(uint32_t pgn, uint8_t priority, uint8_t sa, uint8_t da,
+	const uint8_t *data, int len)
+{
+	struct canfd_frame frame;
+	memset(&frame, 0, sizeof(frame));
+	canid_t id = ((canid_t)(priority & 0x07) << 26) | ((pgn & 0x3ffff) << 8) | sa;
+	if (((pgn >> 8) & 0xff) < 240)
+		id = (id & ~0xff00) | (da << 8);
+	frame.can_id = id | CAN_EFF_FLAG;
+	frame.len = len;
+	memcpy(frame.data, data, len);
+	bulwa_emit_frame(&frame, CAN_MTU);
+}
+
+static void j1939_emit_claim(struct J1939Node *jnode)
+{
+	uint8_t data[8];
+	for (int i = 0; i < 8; ++i)
+		data[i] = jnode->name >> (8 * i);
+	uint8_t sa = (CLAIM_LOST == jnode->state) ? J1939_NULL_ADDRESS : jnode->address;
+	j1939_emit(PGN_ADDRESS_CLAIMED, CLAIM_PRIORITY, sa, 0xff, data, 8);
+}
+
+static void j1939_emit_cm(uint8_t sa, uint8_t da, uint8_t control,
+	uint8_t b1, uint8_t b2, uint8_t b3, uint8_t b4, uint32_t pgn)
+{
+	uint8_t data[8] = { control, b1, b2, b3, b4, pgn & 0xff, (pgn >> 8) & 0xff, pgn >> 16 };
+	j1939_emit(PGN_TP_CM, TP_PRIORITY, sa, da, data, 8);
+}
+
+/*
+ * Passes a message to subscribers. Nodes with an address see only
+ * messages sent to them or broadcast, and never their own ones.
+ */
+static void j1939_deliver(uint32_t pgn, uint8_t priority, uint8_t sa, uint8_t da,
+	const uint8_t *data, int len, unsigned long long int timestamp)
+{
+	// the ids are copied first, as callbacks may subscribe and so reallocate
+	// the lists or rehash the table; a node is at most once on each list
+	int subscribers[2 * j1939_nodes_num + 1];
+	int subscribers_num = 0;
+	struct J1939PgnEntry *entry = j1939_lookup(pgn, false);
+	if (entry && entry->nodes_num)
+	{
+		memcpy(subscribers, entry->nodes, entry->nodes_num * sizeof(int));
+		subscribers_num = entry->nodes_num;
+	}
+	if (any_pgn_nodes_num)
+	{
+		memcpy(subscribers + subscribers_num, any_pgn_nodes, any_pgn_nodes_num * sizeof(int));
+		subscribers_num += any_pgn_nodes_num;
+	}
+
+	for (int i = 0; i < subscribers_num; ++i)
+	{
+		int node_id = subscribers[i];
+		const struct J1939Node *jnode = &j1939_nodes[node_id];
+		if (!nodes[node_id].enabled)
+			continue;
+		if (CLAIM_FIXED == jnode->state || CLAIM_PENDING == jnode->state ||
+			CLAIM_DONE == jnode->state)
+		{
+			if (sa == jnode->address || (0xff != da && da != jnode->address))
+				continue;
+		}
+		node_onpgn(&nodes[node_id], pgn, priority, sa, da, data, len, timestamp);
+	}
+}
+
+static void j1939_onclaim(uint8_t sa, uint64_t name)
+{
+	bool local = false;
+	bool defended = false;
+	for (int i = 0; i < j1939_nodes_num; ++i)
+	{
+		struct J1939Node *jnode = &j1939_nodes[i];
+		if (CLAIM_PENDING != jnode->state && CLAIM_DONE != jnode->state)
+			continue;
+		if (name == jnode->name)
+		{
+			// a claim of the node itself coming back
+			local = true;
+			continue;
+		}
+		if (sa != jnode->address || !nodes[i].enabled)
+			continue;
+
+		// the lower NAME wins
+		if (jnode->name < name)
+		{
+			j1939_emit_claim(jnode);
+			defended = true;
+		}
+		else if (!j1939_claim_next(i))
+		{
+			jnode->state = CLAIM_LOST;
+			j1939_emit_claim(jnode);
+			node_onaddressclaimed(&nodes[i], J1939_NULL_ADDRESS);
+		}
+	}
+
+	// a claimant losing to a simulated node has to move away,
+	// the address is free once the node releases it
+	if (!local && !defended && sa < J1939_NULL_ADDRESS)
+		foreign_used[sa] = true;
+}
+
+static void j1939_onrequest(uint8_t da, uint32_t pgn)
+{
+	if (PGN_ADDRESS_CLAIMED != pgn)
+		return;
+	for (int i = 0; i < j1939_nodes_num; ++i)
+	{
+		struct J1939Node *jnode = &j1939_nodes[i];
+		if (CLAIM_PENDING != jnode->state && CLAIM_DONE != jnode->state &&
+			CLAIM_LOST != jnode->state)
+			continue;
+		if (!nodes[i].enabled || (0xff != da && da != jnode->address))
+			continue;
+		j1939_emit_claim(jnode);
+	}
+}
+
+static void j1939_oncm(uint8_t sa, uint8_t da, const uint8_t *data)
+{
+	uint32_t pgn = j1939_get_pgn(data + 5);
+	int size = data[1] | (data[2] << 8);
+	int receiver = -1;
+	struct J1939Session *session;
+
+	switch (data[0])
+	{
+	case TP_CM_BAM:
+		if (size <= 8 || size > J1939_MAX_SIZE || data[3] != (size + 6) / 7)
+			return;
+		// a new announcement replaces the previous one
+		session = j1939_find_session(TP_RX_BAM, sa, 0xff);
+		if (session)
+			j1939_close_session(session);
+		session = j1939_new_session();
+		if (!session)
+			return;
+		session->data = (uint8_t *)malloc(size);
+		if (!session->data)
+		{
+			j1939_close_session(session);
+			return;
+		}
+		session->type = TP_RX_BAM;
+		session->node = -1;
+		session->sa = sa;
+		session->da = 0xff;
+		session->priority = TP_PRIORITY;
+		session->pgn = pgn;
+		session->size = size;
+		session->packets = data[3];
+		session->next = 1;
+		session->deadline = j1939_now() + TP_T1;
+		break;
+	case TP_CM_RTS:
+		receiver = j1939_find_node(da);
+		if (receiver < 0 || !nodes[receiver].enabled)
+			return;
+		if (size <= 8 || size > J1939_MAX_SIZE || data[3] != (size + 6) / 7)
+		{
+			j1939_emit_cm(da, sa, TP_CM_ABORT, TP_ABORT_RESOURCES, 0xff, 0xff, 0xff, pgn);
+			return;
+		}
+		session = j1939_find_session(TP_RX_CMDT, sa, da);
+		if (session)
+			j1939_close_session(session);
+		session = j1939_new_session();
+		if (session)
+			session->data = (uint8_t *)malloc(size);
+		if (!session || !session->data)
+		{
+			if (session)
+				j1939_close_session(session);
+			j1939_emit_cm(da, sa, TP_CM_ABORT, TP_ABORT_RESOURCES, 0xff, 0xff, 0xff, pgn);
+			return;
+		}
+		session->type = TP_RX_CMDT;
+		session->node = receiver;
+		session->sa = sa;
+		session->da = da;
+		session->priority = TP_PRIORITY;
+		session->pgn = pgn;
+		session->size = size;
+		session->packets = data[3];
+		session->max_per_cts = data[4] ? data[4] : 0xff;
+		session->next = 1;
+		j1939_send_cts(session);
+		break;
+	case TP_CM_CTS:
+		// sent by the receiver, so the addresses are swapped
+		session = j1939_find_session(TP_TX_CMDT, da, sa);
+		if (!session || !session->announced || pgn != session->pgn)
+			return;
+		if (0 == data[1])
+		{
+			// the receiver holds the connection open
+			session->deadline = j1939_now() + TP_T4;
+			return;
+		}
+		if (data[2] < 1 || data[2] > session->packets)
+		{
+			j1939_emit_cm(session->sa, session->da, TP_CM_ABORT, TP_ABORT_RESOURCES,
+				0xff, 0xff, 0xff, pgn);
+			j1939_close_session(session);
+			return;
+		}
+		session->next = data[2];
+		session->window_end = data[2] + data[1] - 1;
+		if (session->window_end > session->packets)
+			session->window_end = session->packets;
+		j1939_send_packets(session, session->window_end);
+		session->deadline = j1939_now() + TP_T3;
+		break;
+	case TP_CM_EOMA:
+		session = j1939_find_session(TP_TX_CMDT, da, sa);
+		if (session && pgn == session->pgn)
+			j1939_close_session(session);
+		break;
+	case TP_CM_ABORT:
+		// either side may abort a connection
+		session = j1939_find_session(TP_TX_CMDT, da, sa);
+		if (session && pgn == session->pgn)
+		{
+			fprintf(stderr, "warning: %s: J1939 transfer of PGN %05x to %02x aborted (reason %d)\n",
+				nodes[session->node].name, pgn, session->da, data[1]);
+			j1939_close_session(session);
+		}
+		session = j1939_find_session(TP_RX_CMDT, sa, da);
+		if (session && pgn == session->pgn)
+			j1939_close_session(session);
+		break;
+	}
+}
+
+static void j1939_ondt(uint8_t sa, uint8_t da, const uint8_t *data,
+	unsigned long long int timestamp)
+{
+	struct J1939Session *session = j1939_find_session(
+		(0xff == da) ? TP_RX_BAM : TP_RX_CMDT, sa, da);
+	if (!session)
+		return;
+	// a lost packet breaks the whole transfer
+	if (data[0] != session->next || (TP_RX_CMDT == session->type && session->next > session->window_end))
+	{
+		if (TP_RX_CMDT == session->type)
+			j1939_emit_cm(da, sa, TP_CM_ABORT, TP_ABORT_TIMEOUT, 0xff, 0xff, 0xff, session->pgn);
+		j1939_close_session(session);
+		return;
+	}
+
+	int offset = (session->next - 1) * 7;
+	int len = session->size - offset < 7 ? session->size - offset : 7;
+	memcpy(session->data + offset, data + 1, len);
+	++session->next;
+	session->deadline = j1939_now() + TP_T1;
+
+	if (session->next <= session->packets)
+	{
+		if (TP_RX_CMDT == session->type && session->next > session->window_end)
+			j1939_send_cts(session);
+		return;
+	}
+
+	if (TP_RX_CMDT == session->type)
+		j1939_emit_cm(da, sa, TP_CM_EOMA, session->size & 0xff, session->size >> 8,
+			session->packets, 0xff, session->pgn);
+
+	// the session is closed first, as callbacks may start new transfers
+	uint32_t pgn = session->pgn;
+	uint8_t priority = session->priority;
+	uint8_t *payload = session->data;
+	int size = session->size;
+	session->data = NULL;
+	j1939_close_session(session);
+	j1939_deliver(pgn, priority, sa, da, payload, size, timestamp);
+	free(payload);
+}
+
+// sends packets starting from session->next up to the last one given
+static void j1939_send_packets(struct J1939Session *session, int last)
+{
+	for (; session->next <= last; ++session->next)
+	{
+		uint8_t data[8];
+		int offset = (session->next - 1) * 7;
+		int len = session->size - offset < 7 ? session->size - offset : 7;
+		memset(data, 0xff, sizeof(data));
+		data[0] = session->next;
+		memcpy(data + 1, session->data + offset, len);
+		j1939_emit(PGN_TP_DT, TP_PRIORITY, session->sa, session->da, data, 8);
+		// BAM packets are sent one at a time
+		if (TP_TX_BAM == session->type)
+		{
+			++session->next;
+			break;
+		}
+	}
+}
+
+static void j1939_send_cts(struct J1939Session *session)
+{
+	int count = session->packets - session->next + 1;
+	if (count > session->max_per_cts)
+		count = session->max_per_cts;
+	session->window_end = session->next + count - 1;
+	session->deadline = j1939_now() + TP_T2;
+	j1939_emit_cm(session->da, session->sa, TP_CM_CTS, count, session->next,
+		0xff, 0xff, session->pgn);
+}
+
+// moves a node that lost its address to the next free one, if it can
+static bool j1939_claim_next(int node_id)
+{
+	struct J1939Node *jnode = &j1939_nodes[node_id];
+	// arbitrary address capable bit of the NAME
+	if (!(jnode->name >> 63))
+		return false;
+	for (int address = ARBITRARY_FIRST; address <= ARBITRARY_LAST; ++address)
+	{
+		if (foreign_used[address] || j1939_find_node(address) >= 0)
+			continue;
+		j1939_claim(node_id, address, jnode->name, true);
+		return true;
+	}
+	return false;
+}
+
+// returns a node using a given address, or -1
+static int j1939_find_node(uint8_t address)
+{
+	for (int i = 0; i < j1939_nodes_num; ++i)
+	{
+		const struct J1939Node *jnode = &j1939_nodes[i];
+		if (address == jnode->address && (CLAIM_FIXED == jnode->state ||
+			CLAIM_PENDING == jnode->state || CLAIM_DONE == jnode->state))
+			return i;
+	}
+	return -1;
+}
+
+static struct J1939Session *j1939_find_session(enum J1939SessionType type,
+	uint8_t sa, uint8_t da)
+{
+	for (int i = 0; i < sessions_num; ++i)
+	{
+		if (type == sessions[i].type && sa == sessions[i].sa && da == sessions[i].da)
+			return &sessions[i];
+	}
+	return NULL;
+}
+
+static struct J1939Session *j1939_new_session(void)
+{
+	if (sessions_num == sessions_cap)
+	{
+		int cap = sessions_cap ? 2 * sessions_cap : 16;
+		struct J1939Session *ptr = (struct J1939Session *)realloc(sessions,
+			cap * sizeof(struct J1939Session));
+		if (!ptr)
+			return NULL;
+		sessions = ptr;
+		sessions_cap = cap;
+	}
+	struct J1939Session *session = &sessions[sessions_num++];
+	memset(session, 0, sizeof(*session));
+	return session;
+}
+
+static void j1939_close_session(struct J1939Session *session)
+{
+	free(session->data);
+	*session = sessions[--sessions_num];
+}
+
+static struct J1939PgnEntry *j1939_lookup(uint32_t pgn, bool insert)
+{
+	if (insert && 2 * (pgn_table_used + 1) > pgn_table_size)
+	{
+		// keep the load factor below one half
+		unsigned int size = 2 * pgn_table_size;
+		struct J1939PgnEntry *table = (struct J1939PgnEntry *)calloc(size, sizeof(struct J1939PgnEntry));
+		if (!table)
+			return NULL;
+		for (unsigned int i = 0; i < pgn_table_size; ++i)
+		{
+			if (!pgn_table[i].used)
+				continue;
+			unsigned int idx = j1939_hash(pgn_table[i].pgn, size);
+			while (table[idx].used)
+				idx = (idx + 1) & (size - 1);
+			table[idx] = pgn_table[i];
+		}
+		free(pgn_table);
+		pgn_table = table;
+		pgn_table_size = size;
+	}
+
+	unsigned int idx = j1939_hash(pgn, pgn_table_size);
+	while (pgn_table[idx].used)
+	{
+		if (pgn == pgn_table[idx].pgn)
+			return &pgn_table[idx];
+		idx = (idx + 1) & (pgn_table_size - 1);
+	}
+	if (!insert)
+		return NULL;
+	pgn_table[idx].used = true;
+	pgn_table[idx].pgn = pgn;
+	++pgn_table_used;
+	return &pgn_table[idx];
+}
+
+static bool j1939_add_subscriber(int **list, int *num, int node_id)
+{
+	for (int i = 0; i < *num; ++i)
+	{
+		if (node_id == (*list)[i])
+			return true;
+	}
+	int *ptr = (int *)realloc(*list, (*num + 1) * sizeof(int));
+	if (!ptr)
+		return false;
+	ptr[(*num)++] = node_id;
+	*list = ptr;
+	return true;
+}
@@ -22,26 +22,130 @@ static int luaenv_enablenode(lua_State *lua);
 static int luaenv_disablenode(lua_State *lua);
 static int luaenv_settimer(lua_State *lua);
 static int luaenv_emit(lua_State *lua);
+static int luaenv_memoryusage(lua_State *lua);
+static int luaenv_sysvar(lua_State *lua);
+static int luaenv_sysvarget(lua_State *lua);
+static int luaenv_sysvarset(lua_State *lua);
+static int luaenv_sysvarsubscribe(lua_State *lua);
+static int luaenv_checksysvar(lua_State *lua, int idx);
+static int luaenv_j1939claim(lua_State *lua);
+static int luaenv_j1939subscribe(lua_State *lua);
+static int luaenv_j1939send(lua_State *lua);
+static int luaenv_profilerstart(lua_State *lua);
+static int luaenv_profilerstop(lua_State *lua);
+static int luaenv_budgetstats(lua_State *lua);
 
-void luaenv_add_custom_api(lua_State *lua, int node_id)
+#define LUAENV_INSTANCE_MT "bulwa.instance_env"
+
+// functions shared by all nodes running in a Lua state
+void luaenv_add_custom_api(lua_State *lua)
+{
+	lua_pushcfunction(lua, luaenv_enablenode);
+	lua_setglobal(lua, "enable_node");
+
+	lua_pushcfunction(lua, luaenv_emit);
+	lua_setglobal(lua, "emit");
+
+	lua_pushcfunction(lua, luaenv_sysvar);
+	lua_setglobal(lua, "sysvar");
+
+	lua_pushcfunction(lua, luaenv_sysvarget);
+	lua_setglobal(lua, "sysvar_get");
+
+	lua_pushcfunction(lua, luaenv_sysvarset);
+	lua_setglobal(lua, "sysvar_set");
+
+	if (diagdb_loaded())
+		luaenv_add_diagdb_api(lua);
+}
+
+// per node API, added to the table on top of the stack
+// (either globals or the environment of an instance)
+void luaenv_add_node_api(lua_State *lua, int node_id)
 {
 	lua_pushstring(lua, nodes[node_id].name);
-	lua_setglobal(lua, "node_name");
+	lua_setfield(lua, -2, "node_name");
 
 	lua_pushinteger(lua, node_id);
-	lua_setglobal(lua, "node_id");
+	lua_setfield(lua, -2, "node_id");
 
-	lua_pushcfunction(lua, luaenv_enablenode);
-	lua_setglobal(lua, "enable_node");
+	lua_pushinteger(lua, nodes[node_id].instance);
+	lua_setfield(lua, -2, "node_instance");
 
-	lua_pushcfunction(lua, luaenv_disablenode);
-	lua_setglobal(lua, "disable_node");
+	lua_pushinteger(lua, node_id);
+	lua_pushcclosure(lua, luaenv_disablenode, 1);
+	lua_setfield(lua, -2, "disable_node");
 
-	lua_pushcfunction(lua, luaenv_settimer);
-	lua_setglobal(lua, "set_timer");
+	lua_pushinteger(lua, node_id);
+	lua_pushcclosure(lua, luaenv_settimer, 1);
+	lua_setfield(lua, -2, "set_timer");
 
-	lua_pushcfunction(lua, luaenv_emit);
-	lua_setglobal(lua, "emit");
+	lua_pushinteger(lua, node_id);
+	lua_pushcclosure(lua, luaenv_memoryusage, 1);
+	lua_setfield(lua, -2, "memory_usage");
+
+	lua_pushinteger(lua, node_id);
+	lua_pushcclosure(lua, luaenv_sysvarsubscribe, 1);
+	lua_setfield(lua, -2, "sysvar_subscribe");
+
+	lua_pushinteger(lua, node_id);
+	lua_pushcclosure(lua, luaenv_j1939claim, 1);
+	lua_setfield(lua, -2, "j1939_claim");
+
+	lua_pushinteger(lua, node_id);
+	lua_pushcclosure(lua, luaenv_j1939subscribe, 1);
+	lua_setfield(lua, -2, "j1939_subscribe");
+
+	lua_pushinteger(lua, node_id);
+	lua_pushcclosure(lua, luaenv_j1939send, 1);
+	lua_setfield(lua, -2, "j1939_send");
+
+	lua_pushinteger(lua, node_id);
+	lua_pushcclosure(lua, luaenv_profilerstart, 1);
+	lua_setfield(lua, -2, "profiler_start");
+
+	lua_pushinteger(lua, node_id);
+	lua_pushcclosure(lua, luaenv_profilerstop, 1);
+	lua_setfield(lua, -2, "profiler_stop");
+
+	lua_pushinteger(lua, node_id);
+	lua_pushcclosure(lua, luaenv_budgetstats, 1);
+	lua_setfield(lua, -2, "budget_stats");
+}
+
+// pushes a new instance environment, globals of the state
+// are visible through it but new ones stay private
+void luaenv_push_instance_env(lua_State *lua)
+{
+	lua_newtable(lua);
+	lua_pushvalue(lua, -1);
+	lua_setfield(lua, -2, "_G");
+	if (luaL_newmetatable(lua, LUAENV_INSTANCE_MT))
+	{
+		lua_pushglobaltable(lua);
+		lua_setfield(lua, -2, "__index");
+	}
+	lua_setmetatable(lua, -2);
+}
+
+// sets the environment on top of the stack (and pops it)
+// as the environment of the main chunk at index idx
+void luaenv_set_chunk_env(lua_State *lua, int idx)
+{
+#ifdef BULWA_LUAJIT
+	// closures inherit the environment of the function creating them
+	lua_setfenv(lua, idx);
+#else
+	// _ENV of the chunk is shared with closures created by previous
+	// instances, so bind the chunk to a fresh upvalue instead of
+	// overwriting the value of the existing one
+	idx = lua_absindex(lua, idx);
+	luaL_loadstring(lua, "local env = ... return function() return env end");
+	lua_insert(lua, -2);
+	lua_call(lua, 1, 1);
+	lua_upvaluejoin(lua, idx, 1, -1, 1);
+	lua_pop(lua, 1);
+#endif
 }
 
 static int luaenv_enablenode(lua_State *lua)
@@ -64,7 +168,8 @@ static int luaenv_disablenode(lua_State *lua)
 {
 	if (lua_gettop(lua) == 0)
 	{
-		lua_getglobal(lua, "node_name");
+		int id = lua_tointeger(lua, lua_upvalueindex(1));
+		lua_pushstring(lua, nodes[id].name);
 	}
 	const char *node_name = luaL_checkstring(lua, 1);
 
@@ -84,16 +189,237 @@ static int luaenv_disablenode(lua_State *lua)
 static int luaenv_settimer(lua_State *lua)
 {
 	lua_Integer interval = (lua_Integer)luaL_checknumber(lua, 1);
-	int rettype = lua_getglobal(lua, "node_id");
-	if (LUA_TNUMBER == rettype)
+	int id = lua_tointeger(lua, lua_upvalueindex(1));
+	node_set_timer(&nodes[id], interval);
+	return 0;
+}
+
+static int luaenv_memoryusage(lua_State *lua)
+{
+	int id = lua_tointeger(lua, lua_upvalueindex(1));
+	if (!nodes[id].alloc)
+		return 0;
+	size_t live, peak, limit;
+	alloc_get_stats(nodes[id].alloc, &live, &peak, &limit);
+	lua_pushinteger(lua, live);
+	lua_pushinteger(lua, peak);
+	lua_pushinteger(lua, limit);
+	return 3;
+}
+
+// returns the handle of a system variable, nil if there is no such variable
+static int luaenv_sysvar(lua_State *lua)
+{
+	int var = sysvar_find(luaL_checkstring(lua, 1));
+	if (var < 0)
+		return 0;
+	lua_pushinteger(lua, var);
+	return 1;
+}
+
+static int luaenv_sysvarget(lua_State *lua)
+{
+	luaenv_push_sysvar(lua, luaenv_checksysvar(lua, 1));
+	return 1;
+}
+
+static int luaenv_sysvarset(lua_State *lua)
+{
+	int var = luaenv_checksysvar(lua, 1);
+	switch (sysvar_get_type(var))
+	{
+	case SV_INT:
+		sysvar_set_int(var, luaL_checkinteger(lua, 2));
+		break;
+	case SV_FLOAT:
+		sysvar_set_float(var, luaL_checknumber(lua, 2));
+		break;
+	case SV_BYTES:
+		if (lua_istable(lua, 2))
+		{
+			// an array of bytes, like the payload of a message
+			unsigned char value[SYSVAR_BYTES_MAX];
+			lua_len(lua, 2);
+			size_t len = luaL_checkinteger(lua, -1);
+			lua_pop(lua, 1);
+			luaL_argcheck(lua, len <= sysvar_get_capacity(var), 2, "too many bytes");
+			for (size_t i = 0; i < len; ++i)
+			{
+				lua_pushinteger(lua, i + 1);
+				lua_gettable(lua, 2);
+				value[i] = luaL_checkinteger(lua, -1);
+				lua_pop(lua, 1);
+			}
+			sysvar_set_bytes(var, value, len);
+		}
+		else
+		{
+			size_t len;
+			const char *value = luaL_checklstring(lua, 2, &len);
+			luaL_argcheck(lua, len <= sysvar_get_capacity(var), 2, "too many bytes");
+			sysvar_set_bytes(var, value, len);
+		}
+		break;
+	}
+	return 0;
+}
+
+static int luaenv_sysvarsubscribe(lua_State *lua)
+{
+	int var = luaenv_checksysvar(lua, 1);
+	int id = lua_tointeger(lua, lua_upvalueindex(1));
+	if (RC_OK != sysvar_subscribe(var, id))
+		return luaL_error(lua, "not enough memory");
+	return 0;
+}
+
+static int luaenv_checksysvar(lua_State *lua, int idx)
+{
+	lua_Integer var = luaL_checkinteger(lua, idx);
+	luaL_argcheck(lua, var == (int)var && sysvar_valid(var), idx, "invalid system variable");
+	return var;
+}
+
+// pushes the value of a system variable, bytes are pushed as a string
+void luaenv_push_sysvar(lua_State *lua, int var)
+{
+	switch (sysvar_get_type(var))
 	{
-		int id = lua_tointeger(lua, -1);
-		node_set_timer(&nodes[id], interval);
+	case SV_INT:
+		lua_pushinteger(lua, sysvar_get_int(var));
+		break;
+	case SV_FLOAT:
+		lua_pushnumber(lua, sysvar_get_float(var));
+		break;
+	case SV_BYTES:
+	{
+		char value[SYSVAR_BYTES_MAX];
+		size_t len = sysvar_get_bytes(var, value);
+		lua_pushlstring(lua, value, len);
+		break;
+	}
 	}
+}
+
+static int luaenv_j1939claim(lua_State *lua)
+{
+	int id = lua_tointeger(lua, lua_upvalueindex(1));
+	lua_Integer address = luaL_checkinteger(lua, 1);
+	luaL_argcheck(lua, address >= 0 && address < J1939_NULL_ADDRESS, 1, "invalid address");
+	uint64_t name = 0;
+	bool has_name = !lua_isnoneornil(lua, 2);
+	// a string keeps all 64 bits of a NAME where numbers are doubles (LuaJIT)
+	if (LUA_TSTRING == lua_type(lua, 2))
+		name = strtoull(lua_tostring(lua, 2), NULL, 0);
+	else if (has_name)
+		name = (uint64_t)luaL_checkinteger(lua, 2);
+	j1939_claim(id, address, name, has_name);
+	return 0;
+}
+
+static int luaenv_j1939subscribe(lua_State *lua)
+{
+	int id = lua_tointeger(lua, lua_upvalueindex(1));
+	lua_Integer pgn = luaL_optinteger(lua, 1, -1);
+	luaL_argcheck(lua, pgn <= 0x3ffff, 1, "invalid PGN");
+	if (RC_OK != j1939_subscribe(id, pgn))
+		return luaL_error(lua, "not enough memory");
+	return 0;
+}
+
+/*
+ * Reads an optional integer field of the table passed as the first argument,
+ * def if absent; errors are reported against that argument.
+ */
+static lua_Integer luaenv_optfield(lua_State *lua, const char *key, lua_Integer def,
+	lua_Integer min, lua_Integer max, const char *extramsg)
+{
+	int isnum = 1;
+	lua_Integer value = def;
+	lua_getfield(lua, 1, key);
+	if (!lua_isnil(lua, -1))
+		value = lua_tointegerx(lua, -1, &isnum);
 	lua_pop(lua, 1);
+	luaL_argcheck(lua, isnum && value >= min && value <= max, 1, extramsg);
+	return value;
+}
+
+// returns true if a message has been sent or its transfer has started
+static int luaenv_j1939send(lua_State *lua)
+{
+	int id = lua_tointeger(lua, lua_upvalueindex(1));
+	uint8_t data[J1939_MAX_SIZE];
+
+	lua_settop(lua, 1);
+	luaL_checktype(lua, 1, LUA_TTABLE);
+
+	lua_Integer pgn = luaenv_optfield(lua, "pgn", -1, 0, 0x3ffff, "invalid PGN");
+	lua_Integer da = luaenv_optfield(lua, "da", 0xff, 0, 0xff, "invalid destination address");
+	lua_Integer priority = luaenv_optfield(lua, "priority", 6, 0, 7, "invalid priority");
+
+	lua_len(lua, 1);
+	lua_Integer len = luaL_checkinteger(lua, -1);
+	lua_pop(lua, 1);
+	luaL_argcheck(lua, len <= J1939_MAX_SIZE, 1, "message too long");
+	for (int i = 0; i < len; ++i)
+	{
+		lua_rawgeti(lua, 1, i + 1);
+		data[i] = luaL_checkinteger(lua, -1);
+		lua_pop(lua, 1);
+	}
+
+	int err = j1939_send(id, pgn, priority, da, data, len);
+	if (RC_MEMORY == err)
+		return luaL_error(lua, "not enough memory");
+	lua_pushboolean(lua, RC_OK == err);
+	return 1;
+}
+
+// optional sampling period in microseconds
+static int luaenv_profilerstart(lua_State *lua)
+{
+	lua_Integer period = luaL_optinteger(lua, 1, PROFILER_DEFAULT_PERIOD);
+	if (period <= 0)
+		return luaL_argerror(lua, 1, "period must be positive");
+	int id = lua_tointeger(lua, lua_upvalueindex(1));
+	if (RC_OK != profiler_start(&nodes[id], period))
+		return luaL_error(lua, "cannot start the profiler");
+	return 0;
+}
+
+static int luaenv_profilerstop(lua_State *lua)
+{
+	int id = lua_tointeger(lua, lua_upvalueindex(1));
+	profiler_stop(&nodes[id]);
 	return 0;
 }
 
+// overruns and the longest callback (in microseconds) of a node
+// given by name or the calling one, nothing if it has no budget
+static int luaenv_budgetstats(lua_State *lua)
+{
+	int id = lua_tointeger(lua, lua_upvalueindex(1));
+	if (!lua_isnoneornil(lua, 1))
+	{
+		const char *node_name = luaL_checkstring(lua, 1);
+		id = -1;
+		for (int i = 0; i < nodes_num && id < 0; ++i)
+		{
+			if (!strcmp(nodes[i].name, node_name))
+				id = i;
+		}
+		if (id < 0)
+			return 0;
+	}
+	if (!nodes[id].budget)
+		return 0;
+	unsigned long long overruns, longest_us;
+	budget_get_stats(nodes[id].budget, &overruns, &longest_us);
+	lua_pushinteger(lua, overruns);
+	lua_pushinteger(lua, longest_us);
+	return 2;
+}
+
 static int luaenv_emit(lua_State *lua)
 {
 	struct canfd_frame frame;
@@ -177,10 +503,27 @@ static int luaenv_emit(lua_State *lua)
 		lua_pop(lua, 1);
 	}
 
-	int nbytes = write(s, &frame, mtu);
+	bulwa_emit_frame(&frame, mtu);
+	return 0;
+}
+
+/*
+ * Common transmit path for the table based emit and the FFI one,
+ * it has external linkage so that LuaJIT scripts can call it directly.
+ */
+int bulwa_emit_frame(const struct canfd_frame *frame, int mtu)
+{
+	if (mtu != CAN_MTU && mtu != CANFD_MTU)
+		return -1;
+	// sent in a batch when the main loop waits, errors are reported
+	// once it has completed, so 0 only means that the frame is queued
+	if (uring_active())
+		return uring_emit(frame, mtu);
+	int nbytes = write(s, frame, mtu);
 	if (nbytes != CAN_MTU && nbytes != CANFD_MTU)
 	{
 		fprintf(stderr, "critical: cannot send a message\n");
+		return -1;
 	}
 	return 0;
 }
@@ -23,6 +23,10 @@
 #include <signal.h>
 #include <time.h>
 
+// frames read from the CAN socket per wakeup of the poll path,
+// remote nodes get them in a single message
+#define RX_BATCH	64
+
 enum TimestampType
 {
 	TT_NONE,
@@ -32,22 +36,40 @@ enum TimestampType
 
 // CAN socket
 int s;
+// receive buffer, also exposed to LuaJIT scripts via FFI
+struct canfd_frame rx_frame;
 
 struct ScriptNode *nodes = NULL;
 int nodes_num = 0;
+// node whose script is being executed, NULL in the main loop
+struct ScriptNode *running_node = NULL;
+
+static volatile sig_atomic_t interrupted = 0;
 
 static void nodes_init(int num);
 static void nodes_deinit(void);
 
 static void node_destroy(struct ScriptNode *node);
+static void node_hook(lua_State *lua, lua_Debug *ar);
 
 static int node_onenable(struct ScriptNode *node);
 static int node_ondisable(struct ScriptNode *node);
 static int node_onmessage(struct ScriptNode *node, struct canfd_frame *frame,
 	int mtu, unsigned long long int timestamp);
 static int node_ontimer(struct ScriptNode *node);
+static int node_onsysvar(struct ScriptNode *node, int var);
+#ifdef BULWA_LUAJIT
+static int node_onframe(struct ScriptNode *node, struct canfd_frame *frame,
+	int mtu, unsigned long long int timestamp);
+#endif
+
+static int node_callback_error(struct ScriptNode *node, int err);
+
+static unsigned long long int get_timestamp(struct msghdr *msg, enum TimestampType type);
+static void dispatch_frame(int nbytes, unsigned long long int timestamp);
 
 static void finalize(void);
+static void on_interrupt(int sig);
 
 int main(int argc, char *argv[])
 {
@@ -137,16 +159,53 @@ int main(int argc, char *argv[])
 
 	// to do - count dropped frames (SO_RXQ_OVFL)
 
+	// io_uring replaces poll and per frame system calls if the kernel allows
+	if (config_get_io_uring())
+	{
+		if (RC_OK == uring_init(s))
+			printf("io_uring socket backend enabled\n\n");
+		else
+			fprintf(stderr, "warning: io_uring not available, falling back to poll\n");
+	}
+
+	// endpoint for remote nodes
+	const char *remote_path = NULL;
+	int remote_port = 0;
+	if (config_get_remote(&remote_path, &remote_port))
+	{
+		if (RC_OK != remote_init(remote_path, remote_port))
+		{
+			fprintf(stderr, "cannot open the endpoint for remote nodes\n");
+			return RC_BIND;
+		}
+		if (remote_path)
+			printf("remote nodes accepted at %s\n\n", remote_path);
+		else
+			printf("remote nodes accepted at 127.0.0.1:%d\n\n", remote_port);
+	}
+
+	// diagnostic database is mapped once and shared by all nodes
+	const char *diagdb_path = config_get_diagdb_path();
+	if (diagdb_path)
+	{
+		if (RC_OK != diagdb_open(diagdb_path))
+			return RC_CONFIGFILE;
+		printf("diagnostic database %s loaded\n\n", diagdb_path);
+	}
+
+	// nodes may be profiled from the configuration or at runtime
+	profiler_init(config_get_profile_output());
+
+	// system variables are defined before nodes refer to them
+	if (RC_OK != config_load_sysvars())
+		return RC_CONFIGFILE;
+
 	// load node configuration
 	int nodenum = config_get_node_num();
 	nodes_init(nodenum);
-	int err = RC_OK;
-	for (int i = 0; i < nodenum; ++i)
-	{
-		err = config_load_node(i, &nodes[i]);
-		if (err != RC_OK)
-			return RC_INIT;
-	}
+	j1939_init(nodenum);
+	if (RC_OK != config_load_nodes(nodes, nodenum))
+		return RC_INIT;
 
 	// enable nodes
 	for (int i = 0; i < nodenum; ++i)
@@ -157,81 +216,81 @@ int main(int argc, char *argv[])
 
 	atexit(finalize);
 
-	struct pollfd fds;
-	fds.fd = s;
-	fds.events = POLLIN;
+	// the first SIGINT or SIGTERM leaves the main loop, so that nodes are
+	// disabled and the profile is written, the second one terminates
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_interrupt;
+	sa.sa_flags = SA_RESETHAND | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	// CAN socket goes first, followed by remote nodes if any
+	struct pollfd fds[1 + REMOTE_MAX_POLLFDS];
+	// milliseconds until the nearest node timer expires
+	int timer_timeout = 50;
 
 	while (1)
 	{
-		if (poll(&fds, 1, 50) > 0)
+		fds[0].fd = s;
+		fds[0].events = POLLIN;
+		fds[0].revents = 0;
+		int fds_num = 1 + remote_get_pollfds(fds + 1, REMOTE_MAX_POLLFDS);
+
+		// do not wait if callbacks changed system variables,
+		// J1939 transport needs to keep its timing
+		int timeout = sysvar_changes_pending() ? 0 : timer_timeout;
+		timeout = j1939_get_timeout(timeout);
+
+		bool uring = uring_active();
+		int ready = uring ? uring_wait(fds, fds_num, timeout) : poll(fds, fds_num, timeout);
+		if (ready > 0)
 		{
-			if (fds.revents & POLLIN)
-			{
-				// there is data to read
-				struct msghdr msg;
-				struct iovec iov;
-				char ctrlmsg[CMSG_SPACE(sizeof(struct timeval)) +
-					CMSG_SPACE(3 * sizeof(struct timespec))];
-				struct canfd_frame frame;
-
-				memset(&msg, 0, sizeof(msg));
-				iov.iov_base = &frame;
-				iov.iov_len = sizeof(frame);
-				msg.msg_iov = &iov;
-				msg.msg_iovlen = 1;
-				msg.msg_control = ctrlmsg;
-				msg.msg_controllen = sizeof(ctrlmsg);
-
-				int nbytes = recvmsg(fds.fd, &msg, 0);
-				if (nbytes < 0)
-				{
-					fprintf(stderr, "recvmsg error\n");
-					return RC_SOCKETREAD;
-				}
+			// frames emitted by remote nodes come back through the CAN socket
+			remote_process(fds + 1, fds_num - 1);
 
-				unsigned long long int timestamp = 0;
-				if (msg.msg_control && msg.msg_controllen)
+			if (fds[0].revents & POLLIN)
+			{
+				// there is data to read, a whole batch of frames
+				int batch = 0;
+				do
 				{
-					for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
-						cmsg && (cmsg->cmsg_level == SOL_SOCKET);
-						cmsg = CMSG_NXTHDR(&msg,cmsg))
+					struct msghdr msg;
+					struct iovec iov;
+					char ctrlmsg[RX_CONTROL_SIZE];
+
+					memset(&msg, 0, sizeof(msg));
+					iov.iov_base = &rx_frame;
+					iov.iov_len = sizeof(rx_frame);
+					msg.msg_iov = &iov;
+					msg.msg_iovlen = 1;
+					msg.msg_control = ctrlmsg;
+					msg.msg_controllen = sizeof(ctrlmsg);
+
+					int nbytes = uring ? uring_recvmsg(&msg) :
+						recvmsg(fds[0].fd, &msg, MSG_DONTWAIT);
+					if (nbytes < 0 && !uring && (EAGAIN == errno || EWOULDBLOCK == errno))
+						break;
+					if (nbytes < 0)
 					{
-						if (timestamp_type == TT_TIMESTAMP && cmsg->cmsg_type == SO_TIMESTAMP)
-						{
-							struct timeval *tv = (struct timeval *)CMSG_DATA(cmsg);
-							timestamp = tv->tv_usec * 1000 + tv->tv_sec * 1000000000;
-						} else if (timestamp_type == TT_TIMESTAMPING && cmsg->cmsg_type == SO_TIMESTAMPING)
-						{
-							struct timespec *stamp = (struct timespec *)CMSG_DATA(cmsg);
-							/*
-							 * stamp[0] is the software timestamp
-							 * stamp[1] is deprecated
-							 * stamp[2] is the raw hardware timestamp
-							 * See chapter 2.1.2 Receive timestamps in
-							 * linux/Documentation/networking/timestamping.txt
-							 */
-							//if (stamp[2].tv_nsec || stamp[2].tv_sec)
-							//	stamp += 2;		// read timestamp from stamp[2]
-							timestamp = stamp->tv_nsec + stamp->tv_sec * 1000000000;
-						}
+						fprintf(stderr, "recvmsg error\n");
+						return RC_SOCKETREAD;
 					}
-				}
+					if (0 == nbytes)
+						break;
 
-				// on_message callback
-				for (int i = 0; i < nodenum; ++i)
-				{
-					if (nodes[i].enabled)
-						node_onmessage(&nodes[i], &frame, nbytes, timestamp);
-				}
+					dispatch_frame(nbytes, get_timestamp(&msg, timestamp_type));
+				} while (uring || ++batch < RX_BATCH);
 			}
-			else if (fds.revents & POLLERR)
+			else if (fds[0].revents & POLLERR)
 			{
 				fprintf(stderr, "error reading from socket, have you forgot to set bitrate and set up %s?\n", canif_name);
 				return RC_SOCKETREAD;
 			}
-			else
+			else if (fds[0].revents)
 			{
-				fprintf(stderr, "weird thing happened: revents == %0x\n", fds.revents);
+				fprintf(stderr, "weird thing happened: revents == %0x\n", fds[0].revents);
 			}
 		}
 		else
@@ -239,7 +298,11 @@ int main(int argc, char *argv[])
 			// timeout
 		}
 
-		// on_timer callback
+		// J1939 transport and address claim timeouts
+		j1939_process();
+
+		// on_timer callback, the nearest expiry shortens the next wait
+		timer_timeout = 50;
 		for (int i = 0; i < nodenum; ++i)
 		{
 			if (nodes[i].enabled && nodes[i].timer_interval)
@@ -249,12 +312,35 @@ int main(int argc, char *argv[])
 				if (0 == ts.it_value.tv_sec && 0 == ts.it_value.tv_nsec)
 				{
 					node_ontimer(&nodes[i]);
+					if (!nodes[i].enabled || nodes[i].timer_interval <= 0)
+						continue;
+					timer_gettime(nodes[i].timerid, &ts);
 				}
+				int left = ts.it_value.tv_sec * 1000 + (ts.it_value.tv_nsec + 999999) / 1000000;
+				if (left < timer_timeout)
+					timer_timeout = left;
+			}
+		}
+
+		// on_sysvar callback
+		int changes_num;
+		const int *changes = sysvar_get_changes(&changes_num);
+		for (int i = 0; i < changes_num; ++i)
+		{
+			int subscribers_num;
+			const int *subscribers = sysvar_get_subscribers(changes[i], &subscribers_num);
+			for (int j = 0; j < subscribers_num; ++j)
+			{
+				if (nodes[subscribers[j]].enabled)
+					node_onsysvar(&nodes[subscribers[j]], changes[i]);
 			}
 		}
 
-		// check if any of nodes is enabled
-		bool all_dead = true;
+		// received frames are sent to remote nodes in batches
+		remote_flush();
+
+		// check if any of nodes is enabled, remote nodes may connect anytime
+		bool all_dead = !remote_enabled();
 		for (int i = 0; i < nodenum; ++i)
 		{
 			if (nodes[i].enabled)
@@ -268,17 +354,70 @@ int main(int argc, char *argv[])
 			printf("All nodes are disabled. Graceful exit.\n");
 			break;
 		}
+		if (interrupted)
+		{
+			printf("Interrupted. Graceful exit.\n");
+			break;
+		}
 	}
 
 	return 0;
 }
 
+static unsigned long long int get_timestamp(struct msghdr *msg, enum TimestampType type)
+{
+	unsigned long long int timestamp = 0;
+	if (msg->msg_control && msg->msg_controllen)
+	{
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(msg);
+			cmsg && (cmsg->cmsg_level == SOL_SOCKET);
+			cmsg = CMSG_NXTHDR(msg,cmsg))
+		{
+			if (type == TT_TIMESTAMP && cmsg->cmsg_type == SO_TIMESTAMP)
+			{
+				struct timeval *tv = (struct timeval *)CMSG_DATA(cmsg);
+				timestamp = tv->tv_usec * 1000 + tv->tv_sec * 1000000000;
+			} else if (type == TT_TIMESTAMPING && cmsg->cmsg_type == SO_TIMESTAMPING)
+			{
+				struct timespec *stamp = (struct timespec *)CMSG_DATA(cmsg);
+				/*
+				 * stamp[0] is the software timestamp
+				 * stamp[1] is deprecated
+				 * stamp[2] is the raw hardware timestamp
+				 * See chapter 2.1.2 Receive timestamps in
+				 * linux/Documentation/networking/timestamping.txt
+				 */
+				//if (stamp[2].tv_nsec || stamp[2].tv_sec)
+				//	stamp += 2;		// read timestamp from stamp[2]
+				timestamp = stamp->tv_nsec + stamp->tv_sec * 1000000000;
+			}
+		}
+	}
+	return timestamp;
+}
+
+// rx_frame holds the received frame
+static void dispatch_frame(int nbytes, unsigned long long int timestamp)
+{
+	// on_message callback
+	for (int i = 0; i < nodes_num; ++i)
+	{
+		if (nodes[i].enabled)
+			node_onmessage(&nodes[i], &rx_frame, nbytes, timestamp);
+	}
+	remote_onmessage(&rx_frame, nbytes, timestamp);
+	// on_pgn callback
+	j1939_onmessage(&rx_frame, nbytes, timestamp);
+}
+
 static void finalize(void)
 {
 	/* needed to do as atexit callback as
 	 * a Lua script can exit the process as well
 	 */
 	config_unload();
+	remote_deinit();
+	uring_deinit();
 	close(s);
 
 	for (int i = 0; i < nodes_num; ++i)
@@ -287,10 +426,21 @@ static void finalize(void)
 			node_disable(&nodes[i]);
 	}
 
+	// the profile refers to names and states of the nodes
+	profiler_deinit();
+
 	for (int i = 0; i < nodes_num; ++i)
 	{
 		node_destroy(&nodes[i]);
 	}
+	sysvar_deinit();
+	j1939_deinit();
+	diagdb_close();
+}
+
+static void on_interrupt(int sig)
+{
+	interrupted = 1;
 }
 
 static void nodes_init(int num)
@@ -308,17 +458,176 @@ static void nodes_deinit(void)
 
 static void node_destroy(struct ScriptNode *node)
 {
-	if (node->lua)
+	// instances of a template are closed along with the first one
+	if (node->lua && node->owns_lua)
+	{
 		lua_close(node->lua);
+		alloc_destroy(node->alloc);
+	}
 	node->lua = NULL;
+	node->alloc = NULL;
+	budget_destroy(node->budget);
+	node->budget = NULL;
+	free(node->name);
+	node->name = NULL;
 	if (node->timer_interval)
 		timer_delete(node->timerid);
 	node->timer_interval = 0;
 }
 
+/*
+ * Calls a function of a node, the memory limit is enforced only
+ * while scripts run, as C code pushing values onto the stack
+ * is not protected from allocation errors.
+ */
+int node_pcall(struct ScriptNode *node, int nargs, int nresults)
+{
+	// calls may nest, e.g. through enable_node
+	struct ScriptNode *caller = running_node;
+	running_node = node;
+	// the budget applies to callbacks, not to the main chunk
+	const char *callback = node->callback;
+	node->callback = NULL;
+	bool budgeted = node->budget && callback;
+	if (budgeted)
+		budget_begin(node->budget, callback);
+	int token = node->profile ? profiler_call_begin(node) : 0;
+	bool enforced = alloc_enforce(node->alloc, true);
+	int err = lua_pcall(node->lua, nargs, nresults, 0);
+	alloc_enforce(node->alloc, enforced);
+	// the profiler may have been started by the call
+	if (node->profile)
+		profiler_call_end(node, token);
+	// restore the hook count after an overrun
+	if (budgeted && budget_end(node->budget) && budget_exceeded(node->budget))
+		node_update_hook(node);
+	running_node = caller;
+	return err;
+}
+
+// instructions between calls of the count hook, 0 if not needed
+static int node_hook_count(struct ScriptNode *node)
+{
+	if (node->budget)
+		return budget_get_hook_count(node->budget);
+	if (profiler_active(node))
+		return NODE_HOOK_COUNT;
+	return 0;
+}
+
+/*
+ * The count hook is shared by the profiler and the budget of
+ * a node, it is installed only if either of them needs it.
+ */
+void node_update_hook(struct ScriptNode *node)
+{
+	int count = node_hook_count(node);
+	if (count)
+		lua_sethook(node->lua, node_hook, LUA_MASKCOUNT, count);
+#ifdef BULWA_LUAJIT
+	// the hook is shared by all threads of a LuaJIT state,
+	// leave it in place for other instances of a template
+	else if (LUA_NOREF == node->chunk_ref)
+#else
+	else
+#endif
+		lua_sethook(node->lua, NULL, 0, 0);
+}
+
+static void node_hook(lua_State *lua, lua_Debug *ar)
+{
+	struct ScriptNode *node = running_node;
+	if (!node)
+		return;
+	if (node->profile)
+		profiler_hook(node, lua);
+	if (node->budget && budget_hook(node->budget))
+	{
+		// from now on every instruction fails, errors caught
+		// by the script are raised again until the callback ends
+		lua_sethook(lua, node_hook, LUA_MASKCOUNT, 1);
+		if (lua != node->lua)
+			lua_sethook(node->lua, node_hook, LUA_MASKCOUNT, 1);
+		luaL_error(lua, "%s", budget_get_message(node->budget));
+	}
+#ifndef BULWA_LUAJIT
+	// a coroutine keeps the hook it last ran with, e.g. the one of an
+	// overrun or of a profiler stopped meanwhile, until it is resumed
+	if (lua != node->lua)
+	{
+		int count = node_hook_count(node);
+		if (lua_gethookcount(lua) != count)
+			lua_sethook(lua, count ? node_hook : NULL, count ? LUA_MASKCOUNT : 0, count);
+	}
+#endif
+}
+
+// prints (and pops) the error of a failed call
+int node_report_error(struct ScriptNode *node, int err)
+{
+	int rc = RC_CALL;
+	if (LUA_ERRMEM == err && node->alloc && alloc_limit_hit(node->alloc))
+	{
+		size_t live, peak, limit;
+		alloc_get_stats(node->alloc, &live, &peak, &limit);
+		fprintf(stderr, "%s: memory limit of %zu bytes exceeded\n", node->name, limit);
+		rc = RC_MEMORY;
+	}
+	else
+	{
+		fprintf(stderr, "%s: %s\n", node->name, lua_tostring(node->lua, -1));
+		if (node->budget && budget_exceeded(node->budget))
+			rc = RC_BUDGET;
+	}
+	lua_pop(node->lua, 1);
+	return rc;
+}
+
+// a node that runs out of its memory limit or too often
+// exceeds its budget is disabled
+static int node_callback_error(struct ScriptNode *node, int err)
+{
+	int rc = node_report_error(node, err);
+	if (RC_MEMORY == rc && node->enabled)
+		node_disable(node);
+	if (RC_BUDGET == rc && node->enabled && budget_quarantine(node->budget))
+	{
+		unsigned long long overruns, longest_us;
+		budget_get_stats(node->budget, &overruns, &longest_us);
+		fprintf(stderr, "%s: quarantined after %llu budget overrun(s)\n", node->name, overruns);
+		node_disable(node);
+	}
+	return rc;
+}
+
+// pushes a global of the node, looked up in its instance environment if any;
+// used for callbacks, name is expected to be a string literal
+int node_getglobal(struct ScriptNode *node, const char *name)
+{
+	int type;
+	if (LUA_NOREF == node->env_ref)
+	{
+		type = lua_getglobal(node->lua, name);
+	}
+	else
+	{
+		lua_rawgeti(node->lua, LUA_REGISTRYINDEX, node->env_ref);
+		lua_getfield(node->lua, -1, name);
+		lua_remove(node->lua, -2);
+		type = lua_type(node->lua, -1);
+	}
+	// only a callback about to be called is looked up
+	node->callback = LUA_TFUNCTION == type ? name : NULL;
+	if (node->profile && node->callback)
+		profiler_lookup(node, name);
+	return type;
+}
+
 void node_enable(struct ScriptNode *node)
 {
 	node->enabled = true;
+	if (node->budget)
+		budget_reset(node->budget);
 	node_onenable(node);
 }
 
@@ -373,15 +682,12 @@ void node_set_timer(struct ScriptNode *node, lua_Integer interval)
 static int node_onenable(struct ScriptNode *node)
 {
 	int err = 0;
-	int rettype = lua_getglobal(node->lua, "on_enable");
+	int rettype = node_getglobal(node, "on_enable");
 	if (LUA_TFUNCTION == rettype)
 	{
-		err = lua_pcall(node->lua, 0, 0, 0);
+		err = node_pcall(node, 0, 0);
 		if (err)
-		{
-			fprintf(stderr, "%s\n", lua_tostring(node->lua, -1));
-			return RC_CALL;
-		}
+			return node_callback_error(node, err);
 	}
 	else
 	{
@@ -394,15 +700,12 @@ static int node_onenable(struct ScriptNode *node)
 static int node_ondisable(struct ScriptNode *node)
 {
 	int err = 0;
-	int rettype = lua_getglobal(node->lua, "on_disable");
+	int rettype = node_getglobal(node, "on_disable");
 	if (LUA_TFUNCTION == rettype)
 	{
-		err = lua_pcall(node->lua, 0, 0, 0);
+		err = node_pcall(node, 0, 0);
 		if (err)
-		{
-			fprintf(stderr, "%s\n", lua_tostring(node->lua, -1));
-			return RC_CALL;
-		}
+			return node_callback_error(node, err);
 	}
 	else
 	{
@@ -415,7 +718,13 @@ static int node_ondisable(struct ScriptNode *node)
 static int node_onmessage(struct ScriptNode *node, struct canfd_frame *frame, int mtu, unsigned long long int timestamp)
 {
 	int err = 0;
-	int rettype = lua_getglobal(node->lua, "on_message");
+#ifdef BULWA_LUAJIT
+	// on_frame takes precedence and skips table marshalling
+	if (LUA_TFUNCTION == node_getglobal(node, "on_frame"))
+		return node_onframe(node, frame, mtu, timestamp);
+	lua_pop(node->lua, 1);
+#endif
+	int rettype = node_getglobal(node, "on_message");
 	if (LUA_TFUNCTION == rettype)
 	{
 		int dlc = 0;
@@ -482,12 +791,9 @@ static int node_onmessage(struct ScriptNode *node, struct canfd_frame *frame, in
 			lua_settable(node->lua, -3);
 		}
 		// callback function call
-		err = lua_pcall(node->lua, 1, 0, 0);
+		err = node_pcall(node, 1, 0);
 		if (err)
-		{
-			fprintf(stderr, "%s\n", lua_tostring(node->lua, -1));
-			return RC_CALL;
-		}
+			return node_callback_error(node, err);
 	}
 	else
 	{
@@ -497,20 +803,34 @@ static int node_onmessage(struct ScriptNode *node, struct canfd_frame *frame, in
 	return RC_OK;
 }
 
+#ifdef BULWA_LUAJIT
+static int node_onframe(struct ScriptNode *node, struct canfd_frame *frame, int mtu, unsigned long long int timestamp)
+{
+	// on_frame function is on the stack already
+	// the script sees the frame through a pointer to rx_frame
+	if (frame != &rx_frame)
+		memcpy(&rx_frame, frame, sizeof(rx_frame));
+	luaenv_push_rx_frame(node->lua);
+	lua_pushinteger(node->lua, mtu);
+	lua_pushnumber(node->lua, (lua_Number)timestamp);
+	int err = node_pcall(node, 3, 0);
+	if (err)
+		return node_callback_error(node, err);
+	return RC_OK;
+}
+#endif
+
 static int node_ontimer(struct ScriptNode *node)
 {
 	int err = 0;
-	int rettype = lua_getglobal(node->lua, "on_timer");
+	int rettype = node_getglobal(node, "on_timer");
 	if (LUA_TFUNCTION == rettype)
 	{
 		lua_pushinteger(node->lua, node->timer_interval);
 		node->timer_interval = -1;	// temporary marker
-		err = lua_pcall(node->lua, 1, 1, 0);
+		err = node_pcall(node, 1, 1);
 		if (err)
-		{
-			fprintf(stderr, "%s\n", lua_tostring(node->lua, -1));
-			return RC_CALL;
-		}
+			return node_callback_error(node, err);
 		if (!lua_isnil(node->lua, -1))
 		{
 			// if we return anything, set it as interval
@@ -538,3 +858,79 @@ static int node_ontimer(struct ScriptNode *node)
 	}
 	return RC_OK;
 }
+
+static int node_onsysvar(struct ScriptNode *node, int var)
+{
+	int err = 0;
+	int rettype = node_getglobal(node, "on_sysvar");
+	if (LUA_TFUNCTION == rettype)
+	{
+		lua_pushinteger(node->lua, var);
+		luaenv_push_sysvar(node->lua, var);
+		err = node_pcall(node, 2, 0);
+		if (err)
+			return node_callback_error(node, err);
+	}
+	else
+	{
+		printf("warning: no valid on_sysvar function for node %s\n", node->name);
+		lua_pop(node->lua, 1);
+	}
+	return RC_OK;
+}
+
+int node_onpgn(struct ScriptNode *node, uint32_t pgn, uint8_t priority, uint8_t sa,
+	uint8_t da, const uint8_t *data, int len, unsigned long long int timestamp)
+{
+	int err = 0;
+	int rettype = node_getglobal(node, "on_pgn");
+	if (LUA_TFUNCTION == rettype)
+	{
+		lua_newtable(node->lua);
+		lua_pushinteger(node->lua, pgn);
+		lua_setfield(node->lua, -2, "pgn");
+		lua_pushinteger(node->lua, priority);
+		lua_setfield(node->lua, -2, "priority");
+		lua_pushinteger(node->lua, sa);
+		lua_setfield(node->lua, -2, "sa");
+		lua_pushinteger(node->lua, da);
+		lua_setfield(node->lua, -2, "da");
+		// timestamp of the last frame of a message in nanoseconds
+		lua_pushinteger(node->lua, timestamp);
+		lua_setfield(node->lua, -2, "timestamp");
+		// payload
+		for (int i = 0; i < len; ++i)
+		{
+			lua_pushinteger(node->lua, data[i]);
+			lua_rawseti(node->lua, -2, i + 1);
+		}
+		err = node_pcall(node, 1, 0);
+		if (err)
+			return node_callback_error(node, err);
+	}
+	else
+	{
+		printf("warning: no valid on_pgn function for node %s\n", node->name);
+		lua_pop(node->lua, 1);
+	}
+	return RC_OK;
+}
+
+int node_onaddressclaimed(struct ScriptNode *node, uint8_t address)
+{
+	int err = 0;
+	int rettype = node_getglobal(node, "on_address_claimed");
+	if (LUA_TFUNCTION == rettype)
+	{
+		lua_pushinteger(node->lua, address);
+		err = node_pcall(node, 1, 0);
+		if (err)
+			return node_callback_error(node, err);
+	}
+	else
+	{
+		// the callback is optional
+		lua_pop(node->lua, 1);
+	}
+	return RC_OK;
+}
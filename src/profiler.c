@@ -0,0 +1,433 @@
+/*
+	Bulwa CAN Simulator
+	Copyright (C) 2024 Szymon Morawski
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "global.h"
+
+#include <time.h>
+
+/*
+ * The count hook of a profiled node (see node_hook) checks the
+ * clock; once another period of script time has passed, the Lua
+ * stack is sampled. Script time
+ * only advances inside node_pcall, so short callbacks are sampled
+ * in proportion to the time they take as well.
+ *
+ * Identical stacks are counted in a hash table and written in
+ * the collapsed format of flamegraph tools, one line per stack:
+ * node;callback;outermost frame;...;innermost frame count
+ *
+ * Time spent by C code between looking up a callback and calling
+ * it (i.e. building its arguments) is measured separately and
+ * added as a [marshalling] frame below the callback.
+ */
+#define PROFILER_MAX_DEPTH	64
+#define PROFILER_STACK_MAX	4096
+#define PROFILER_MAX_CALLBACKS	16
+
+struct ProfileStack
+{
+	char *stack;		// NULL for an empty slot
+	uint32_t hash;
+	unsigned long long count;
+};
+
+struct ProfileCallback
+{
+	const char *name;
+	unsigned long long calls;
+	unsigned long long script_ns;
+	unsigned long long marshal_ns;
+};
+
+struct Profile
+{
+	bool active;
+	unsigned long long period;	// ns of script time between samples
+	unsigned long long script_ns;	// script time of finished calls
+	unsigned long long call_start;	// start of the outermost running call
+	unsigned long long next_sample;	// script time of the next sample
+	unsigned long long lookup_start;	// when a callback was looked up, 0 if none
+	int lookup_callback;
+	int callback;			// running callback, -1 if not known
+	int depth;			// nesting of calls of the node
+	unsigned long long samples;
+	struct ProfileStack *stacks;
+	unsigned int stacks_size;
+	unsigned int stacks_used;
+	struct ProfileCallback callbacks[PROFILER_MAX_CALLBACKS];
+	int callbacks_num;
+};
+
+static char *output_path = NULL;
+
+static void profiler_sample(struct ScriptNode *node, lua_State *lua, unsigned long long count);
+static void profiler_add(struct Profile *profile, const char *stack, unsigned long long count);
+static int profiler_callback_index(struct Profile *profile, const char *name);
+static size_t profiler_append(char *buf, size_t pos, const char *str);
+static void profiler_write(FILE *file, struct ScriptNode *node);
+static void profiler_report(struct ScriptNode *node);
+
+static inline unsigned long long profiler_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// FNV-1a
+static inline uint32_t profiler_hash(const char *str)
+{
+	uint32_t h = 2166136261u;
+	while (*str)
+		h = (h ^ (unsigned char)*str++) * 16777619u;
+	return h;
+}
+
+// path is where collapsed stacks of all profiled nodes are written on exit
+void profiler_init(const char *path)
+{
+	free(output_path);
+	output_path = strdup(path);
+}
+
+/*
+ * Writes the output and prints a summary, nodes are expected to be
+ * still in place (names are needed), but not running anymore.
+ */
+void profiler_deinit(void)
+{
+	FILE *file = NULL;
+	for (int i = 0; i < nodes_num; ++i)
+	{
+		struct ScriptNode *node = &nodes[i];
+		if (!node->profile)
+			continue;
+		if (!file && output_path)
+		{
+			file = fopen(output_path, "w");
+			if (!file)
+				fprintf(stderr, "cannot write the profile to %s\n", output_path);
+		}
+		if (file)
+			profiler_write(file, node);
+		profiler_report(node);
+	}
+	if (file)
+	{
+		fclose(file);
+		printf("profile written to %s\n", output_path);
+	}
+
+	for (int i = 0; i < nodes_num; ++i)
+	{
+		struct Profile *profile = nodes[i].profile;
+		if (!profile)
+			continue;
+		for (unsigned int j = 0; j < profile->stacks_size; ++j)
+			free(profile->stacks[j].stack);
+		free(profile->stacks);
+		free(profile);
+		nodes[i].profile = NULL;
+		if (nodes[i].lua)
+			node_update_hook(&nodes[i]);
+	}
+	free(output_path);
+	output_path = NULL;
+}
+
+/*
+ * Starts (or restarts with a new period) sampling of a node, samples
+ * collected so far are kept. May be called by the node itself.
+ */
+int profiler_start(struct ScriptNode *node, unsigned long long period_us)
+{
+	struct Profile *profile = node->profile;
+	if (!profile)
+	{
+		profile = (struct Profile *)calloc(1, sizeof(struct Profile));
+		if (!profile)
+			return RC_MEMORY;
+		profile->callback = -1;
+		node->profile = profile;
+	}
+	if (!period_us)
+		period_us = PROFILER_DEFAULT_PERIOD;
+	profile->period = period_us * 1000;
+
+	// started from within a callback, count the rest of the call
+	unsigned long long now = profiler_now();
+	if (running_node == node && !profile->depth)
+	{
+		profile->call_start = now;
+		profile->depth = 1;
+	}
+	profile->next_sample = profile->script_ns + profile->period;
+	if (profile->depth)
+		profile->next_sample += now - profile->call_start;
+	profile->active = true;
+	node_update_hook(node);
+	return RC_OK;
+}
+
+void profiler_stop(struct ScriptNode *node)
+{
+	struct Profile *profile = node->profile;
+	if (!profile || !profile->active)
+		return;
+	profile->active = false;
+	node_update_hook(node);
+}
+
+bool profiler_active(const struct ScriptNode *node)
+{
+	return node->profile && node->profile->active;
+}
+
+// called by node_getglobal when a callback is about to be called
+void profiler_lookup(struct ScriptNode *node, const char *name)
+{
+	struct Profile *profile = node->profile;
+	if (!profile->active)
+		return;
+	profile->lookup_start = profiler_now();
+	profile->lookup_callback = profiler_callback_index(profile, name);
+}
+
+/*
+ * Called by node_pcall around a call, returns a value
+ * to be passed to profiler_call_end.
+ */
+int profiler_call_begin(struct ScriptNode *node)
+{
+	struct Profile *profile = node->profile;
+	int previous = profile->callback;
+	unsigned long long now = profiler_now();
+
+	// a call without a preceding lookup runs the main chunk
+	int callback = -1;
+	if (profile->active)
+		callback = profile->lookup_start ? profile->lookup_callback :
+			profiler_callback_index(profile, "main chunk");
+	if (callback >= 0)
+	{
+		if (profile->lookup_start)
+			profile->callbacks[callback].marshal_ns += now - profile->lookup_start;
+		++profile->callbacks[callback].calls;
+	}
+	profile->lookup_start = 0;
+	profile->callback = callback;
+
+	if (!profile->depth++)
+		profile->call_start = now;
+	return previous + 1;
+}
+
+void profiler_call_end(struct ScriptNode *node, int token)
+{
+	struct Profile *profile = node->profile;
+	// started in the middle of a nested call
+	if (!profile->depth)
+		return;
+	if (!--profile->depth && profile->active)
+	{
+		unsigned long long elapsed = profiler_now() - profile->call_start;
+		profile->script_ns += elapsed;
+		if (profile->callback >= 0)
+			profile->callbacks[profile->callback].script_ns += elapsed;
+	}
+	profile->callback = token - 1;
+}
+
+// called by the count hook of the running node
+void profiler_hook(struct ScriptNode *node, lua_State *lua)
+{
+	struct Profile *profile = node->profile;
+	if (!profile->active || !profile->depth)
+		return;
+
+	unsigned long long elapsed = profile->script_ns + profiler_now() - profile->call_start;
+	if (elapsed < profile->next_sample)
+		return;
+	// C functions do not run the hook, catch up after a long one
+	unsigned long long count = 1 + (elapsed - profile->next_sample) / profile->period;
+	profile->next_sample += count * profile->period;
+	profiler_sample(node, lua, count);
+}
+
+static void profiler_sample(struct ScriptNode *node, lua_State *lua, unsigned long long count)
+{
+	struct Profile *profile = node->profile;
+	lua_Debug frames[PROFILER_MAX_DEPTH];
+	int depth = 0;
+	while (depth < PROFILER_MAX_DEPTH && lua_getstack(lua, depth, &frames[depth]))
+	{
+		lua_getinfo(lua, "Sn", &frames[depth]);
+		++depth;
+	}
+	lua_Debug extra;
+	bool truncated = lua_getstack(lua, depth, &extra);
+
+	char stack[PROFILER_STACK_MAX];
+	size_t pos = profiler_append(stack, 0, node->name);
+	stack[pos++] = ';';
+	pos = profiler_append(stack, pos, profile->callback >= 0 ?
+		profile->callbacks[profile->callback].name : "unknown");
+	if (truncated)
+	{
+		stack[pos++] = ';';
+		pos = profiler_append(stack, pos, "[truncated]");
+	}
+
+	// frames go from the outermost to the innermost one
+	for (int i = depth - 1; i >= 0; --i)
+	{
+		char frame[256];
+		const lua_Debug *f = &frames[i];
+		if (!strcmp(f->what, "main"))
+			snprintf(frame, sizeof(frame), "%s", f->short_src);
+		else if (!strcmp(f->what, "C"))
+			snprintf(frame, sizeof(frame), "%s [C]", f->name ? f->name : "?");
+		else if (f->name)
+			snprintf(frame, sizeof(frame), "%s %s:%d", f->name, f->short_src, f->linedefined);
+		else
+			snprintf(frame, sizeof(frame), "%s:%d", f->short_src, f->linedefined);
+		if (pos + 2 < sizeof(stack))
+			stack[pos++] = ';';
+		pos = profiler_append(stack, pos, frame);
+	}
+	stack[pos] = '\0';
+
+	profiler_add(profile, stack, count);
+	profile->samples += count;
+}
+
+static void profiler_add(struct Profile *profile, const char *stack, unsigned long long count)
+{
+	if (2 * (profile->stacks_used + 1) > profile->stacks_size)
+	{
+		// keep the load factor below one half
+		unsigned int size = profile->stacks_size ? 2 * profile->stacks_size : 256;
+		struct ProfileStack *stacks = (struct ProfileStack *)calloc(size, sizeof(struct ProfileStack));
+		if (!stacks)
+			return;
+		for (unsigned int i = 0; i < profile->stacks_size; ++i)
+		{
+			if (!profile->stacks[i].stack)
+				continue;
+			unsigned int idx = profile->stacks[i].hash & (size - 1);
+			while (stacks[idx].stack)
+				idx = (idx + 1) & (size - 1);
+			stacks[idx] = profile->stacks[i];
+		}
+		free(profile->stacks);
+		profile->stacks = stacks;
+		profile->stacks_size = size;
+	}
+
+	uint32_t hash = profiler_hash(stack);
+	unsigned int idx = hash & (profile->stacks_size - 1);
+	while (profile->stacks[idx].stack)
+	{
+		if (hash == profile->stacks[idx].hash && !strcmp(stack, profile->stacks[idx].stack))
+		{
+			profile->stacks[idx].count += count;
+			return;
+		}
+		idx = (idx + 1) & (profile->stacks_size - 1);
+	}
+	profile->stacks[idx].stack = strdup(stack);
+	if (!profile->stacks[idx].stack)
+		return;
+	profile->stacks[idx].hash = hash;
+	profile->stacks[idx].count = count;
+	++profile->stacks_used;
+}
+
+// names of callbacks are string literals, compared by address first
+static int profiler_callback_index(struct Profile *profile, const char *name)
+{
+	for (int i = 0; i < profile->callbacks_num; ++i)
+	{
+		if (name == profile->callbacks[i].name || !strcmp(name, profile->callbacks[i].name))
+			return i;
+	}
+	if (profile->callbacks_num == PROFILER_MAX_CALLBACKS)
+		return -1;
+	struct ProfileCallback *callback = &profile->callbacks[profile->callbacks_num];
+	memset(callback, 0, sizeof(*callback));
+	callback->name = name;
+	return profile->callbacks_num++;
+}
+
+// appends a frame name, ';' separates frames in the output
+static size_t profiler_append(char *buf, size_t pos, const char *str)
+{
+	for (; *str && pos + 2 < PROFILER_STACK_MAX; ++str)
+	{
+		char c = *str;
+		if (';' == c)
+			c = ':';
+		else if ('\n' == c)
+			c = ' ';
+		buf[pos++] = c;
+	}
+	buf[pos] = '\0';
+	return pos;
+}
+
+static void profiler_write(FILE *file, struct ScriptNode *node)
+{
+	struct Profile *profile = node->profile;
+	for (unsigned int i = 0; i < profile->stacks_size; ++i)
+	{
+		if (profile->stacks[i].stack)
+			fprintf(file, "%s %llu\n", profile->stacks[i].stack, profile->stacks[i].count);
+	}
+	// marshalling time in units of the sampling period
+	char name[PROFILER_STACK_MAX];
+	profiler_append(name, 0, node->name);
+	for (int i = 0; i < profile->callbacks_num; ++i)
+	{
+		unsigned long long count = (profile->callbacks[i].marshal_ns + profile->period / 2) /
+			profile->period;
+		if (count)
+			fprintf(file, "%s;%s;[marshalling] %llu\n", name,
+				profile->callbacks[i].name, count);
+	}
+}
+
+static void profiler_report(struct ScriptNode *node)
+{
+	struct Profile *profile = node->profile;
+	unsigned long long marshal_ns = 0;
+	for (int i = 0; i < profile->callbacks_num; ++i)
+		marshal_ns += profile->callbacks[i].marshal_ns;
+	printf("profile of %s: %llu samples every %llu us, script %.3f ms, marshalling %.3f ms\n",
+		node->name, profile->samples, profile->period / 1000,
+		profile->script_ns / 1e6, marshal_ns / 1e6);
+	for (int i = 0; i < profile->callbacks_num; ++i)
+	{
+		const struct ProfileCallback *callback = &profile->callbacks[i];
+		// e.g. on_frame looked up, but not defined
+		if (!callback->calls)
+			continue;
+		printf("  %s: %llu calls, script %.3f ms, marshalling %.3f ms\n",
+			callback->name, callback->calls,
+			callback->script_ns / 1e6, callback->marshal_ns / 1e6);
+	}
+}
@@ -0,0 +1,503 @@
+/*
+	Bulwa CAN Simulator
+	Copyright (C) 2024 Szymon Morawski
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+// accept4 and sendmmsg
+#define _GNU_SOURCE
+#include "global.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*
+ * Remote nodes are external processes connected over a Unix or
+ * a loopback TCP socket. Every message starts with struct RemoteHeader
+ * followed by length bytes of payload, integers are in host byte order:
+ *
+ * REMOTE_HELLO   client: node name, server: protocol version (uint32_t)
+ * REMOTE_FILTER  client: array of struct can_filter, frames matching
+ *                any of them are delivered (all frames by default)
+ * REMOTE_FRAMES  array of struct RemoteFrame, received frames going
+ *                to a client or frames to be sent by a client
+ */
+#define REMOTE_VERSION		1
+#define REMOTE_MAX_FILTERS	64
+#define REMOTE_MAX_MESSAGE	(1024 * 1024)
+#define REMOTE_OUT_LIMIT	(4 * 1024 * 1024)
+#define REMOTE_TX_BATCH		64
+
+enum RemoteMessageType
+{
+	REMOTE_HELLO = 1,
+	REMOTE_FILTER,
+	REMOTE_FRAMES
+};
+
+struct RemoteHeader
+{
+	uint16_t type;
+	uint16_t reserved;
+	uint32_t length;
+};
+
+struct RemoteFrame
+{
+	uint64_t timestamp;
+	uint32_t mtu;
+	uint32_t reserved;
+	struct canfd_frame frame;
+};
+
+struct RemoteBuffer
+{
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+struct RemoteClient
+{
+	int fd;
+	char *name;
+	struct can_filter filters[REMOTE_MAX_FILTERS];
+	int filters_num;		// -1 = no filter set, receive everything
+	struct RemoteBuffer in;
+	struct RemoteBuffer out;
+	size_t frames_hdr;		// offset of an open REMOTE_FRAMES header in out
+	bool frames_open;
+	unsigned long dropped;
+};
+
+static int listen_fd = -1;
+static char *socket_path = NULL;
+static struct RemoteClient clients[REMOTE_MAX_CLIENTS];
+static int clients_num = 0;
+
+static void remote_accept(void);
+static bool remote_read(struct RemoteClient *client);
+static bool remote_write(struct RemoteClient *client);
+static bool remote_handle(struct RemoteClient *client, uint16_t type,
+	const char *payload, uint32_t length);
+static void remote_transmit(const struct RemoteFrame *frames, int num);
+static void remote_close(int idx);
+static bool remote_match(const struct RemoteClient *client, canid_t id);
+static bool remote_reserve(struct RemoteBuffer *buf, size_t len);
+static void remote_append(struct RemoteClient *client, uint16_t type,
+	const void *payload, uint32_t length);
+
+int remote_init(const char *path, int port)
+{
+	if (path)
+	{
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (strlen(path) >= sizeof(addr.sun_path))
+			return RC_SOCKET;
+		strcpy(addr.sun_path, path);
+
+		listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (listen_fd < 0)
+			return RC_SOCKET;
+		// a stale socket left by a previous run, anything else is kept
+		struct stat st;
+		if (0 == lstat(path, &st))
+		{
+			if (!S_ISSOCK(st.st_mode))
+			{
+				fprintf(stderr, "%s exists and is not a socket\n", path);
+				remote_deinit();
+				return RC_BIND;
+			}
+			unlink(path);
+		}
+		if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		{
+			remote_deinit();
+			return RC_BIND;
+		}
+		socket_path = strdup(path);
+	}
+	else
+	{
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (listen_fd < 0)
+			return RC_SOCKET;
+		int reuse = 1;
+		setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+		if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		{
+			remote_deinit();
+			return RC_BIND;
+		}
+	}
+
+	if (listen(listen_fd, REMOTE_MAX_CLIENTS) < 0)
+	{
+		remote_deinit();
+		return RC_BIND;
+	}
+	return RC_OK;
+}
+
+void remote_deinit(void)
+{
+	while (clients_num)
+		remote_close(clients_num - 1);
+	if (listen_fd >= 0)
+		close(listen_fd);
+	listen_fd = -1;
+	if (socket_path)
+		unlink(socket_path);
+	free(socket_path);
+	socket_path = NULL;
+}
+
+bool remote_enabled(void)
+{
+	return listen_fd >= 0;
+}
+
+// fills pollfds of the listening socket and of connected clients
+int remote_get_pollfds(struct pollfd *fds, int max)
+{
+	if (listen_fd < 0 || max < 1)
+		return 0;
+	int n = 0;
+	fds[n].fd = listen_fd;
+	fds[n].events = POLLIN;
+	fds[n].revents = 0;
+	++n;
+	for (int i = 0; i < clients_num && n < max; ++i, ++n)
+	{
+		fds[n].fd = clients[i].fd;
+		fds[n].events = POLLIN | (clients[i].out.len ? POLLOUT : 0);
+		fds[n].revents = 0;
+	}
+	return n;
+}
+
+void remote_process(const struct pollfd *fds, int num)
+{
+	// go backwards, closing a client moves the last one into its slot
+	for (int n = num - 1; n > 0; --n)
+	{
+		int i = n - 1;
+		if (i >= clients_num || fds[n].fd != clients[i].fd)
+			continue;
+		bool ok = true;
+		if (fds[n].revents & (POLLIN | POLLHUP | POLLERR))
+			ok = remote_read(&clients[i]);
+		if (ok && (fds[n].revents & POLLOUT))
+			ok = remote_write(&clients[i]);
+		if (!ok)
+			remote_close(i);
+	}
+	if (num > 0 && (fds[0].revents & POLLIN))
+		remote_accept();
+}
+
+// queues a received frame for all clients interested in it
+void remote_onmessage(const struct canfd_frame *frame, int mtu,
+	unsigned long long int timestamp)
+{
+	for (int i = 0; i < clients_num; ++i)
+	{
+		struct RemoteClient *client = &clients[i];
+		if (!client->name || !remote_match(client, frame->can_id))
+			continue;
+		if (client->out.len + sizeof(struct RemoteFrame) > REMOTE_OUT_LIMIT)
+		{
+			// the client does not keep up, do not stall the bus
+			if (!client->dropped++)
+				fprintf(stderr, "warning: remote node %s is too slow, dropping frames\n", client->name);
+			continue;
+		}
+
+		if (!client->frames_open)
+		{
+			remote_append(client, REMOTE_FRAMES, NULL, 0);
+			client->frames_hdr = client->out.len - sizeof(struct RemoteHeader);
+			client->frames_open = true;
+		}
+		if (!remote_reserve(&client->out, sizeof(struct RemoteFrame)))
+			continue;
+		// records are not necessarily aligned in the output buffer
+		struct RemoteFrame rf;
+		memset(&rf, 0, sizeof(rf));
+		rf.timestamp = timestamp;
+		rf.mtu = mtu;
+		memcpy(&rf.frame, frame, mtu < (int)sizeof(rf.frame) ? mtu : (int)sizeof(rf.frame));
+		memcpy(client->out.data + client->out.len, &rf, sizeof(rf));
+		client->out.len += sizeof(rf);
+
+		struct RemoteHeader hdr;
+		memcpy(&hdr, client->out.data + client->frames_hdr, sizeof(hdr));
+		hdr.length += sizeof(rf);
+		memcpy(client->out.data + client->frames_hdr, &hdr, sizeof(hdr));
+	}
+}
+
+// sends out frames batched during the current loop iteration
+void remote_flush(void)
+{
+	for (int i = clients_num - 1; i >= 0; --i)
+	{
+		if (clients[i].out.len && !remote_write(&clients[i]))
+			remote_close(i);
+	}
+}
+
+static void remote_accept(void)
+{
+	while (1)
+	{
+		int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+		if (clients_num >= REMOTE_MAX_CLIENTS)
+		{
+			fprintf(stderr, "warning: too many remote nodes, connection refused\n");
+			close(fd);
+			continue;
+		}
+		int nodelay = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+		struct RemoteClient *client = &clients[clients_num++];
+		memset(client, 0, sizeof(*client));
+		client->fd = fd;
+		client->filters_num = -1;
+	}
+}
+
+static bool remote_read(struct RemoteClient *client)
+{
+	// a single read per event, so that a busy client cannot starve the bus
+	if (!remote_reserve(&client->in, 64 * 1024))
+		return false;
+	ssize_t n = recv(client->fd, client->in.data + client->in.len,
+		client->in.cap - client->in.len, 0);
+	if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno || EINTR == errno))
+		return true;
+	if (n <= 0)
+		return false;
+	client->in.len += n;
+
+	size_t pos = 0;
+	while (client->in.len - pos >= sizeof(struct RemoteHeader))
+	{
+		struct RemoteHeader hdr;
+		memcpy(&hdr, client->in.data + pos, sizeof(hdr));
+		if (hdr.length > REMOTE_MAX_MESSAGE)
+		{
+			fprintf(stderr, "remote node %s: message too long\n", client->name ? client->name : "?");
+			return false;
+		}
+		if (client->in.len - pos - sizeof(hdr) < hdr.length)
+			break;
+		if (!remote_handle(client, hdr.type, client->in.data + pos + sizeof(hdr), hdr.length))
+			return false;
+		pos += sizeof(hdr) + hdr.length;
+	}
+	memmove(client->in.data, client->in.data + pos, client->in.len - pos);
+	client->in.len -= pos;
+	return true;
+}
+
+static bool remote_write(struct RemoteClient *client)
+{
+	// the header of a batch may go out now, so the batch is closed
+	client->frames_open = false;
+	size_t pos = 0;
+	while (pos < client->out.len)
+	{
+		ssize_t n = send(client->fd, client->out.data + pos,
+			client->out.len - pos, MSG_NOSIGNAL);
+		if (n < 0 && (EAGAIN == errno || EWOULDBLOCK == errno))
+			break;
+		if (n < 0 && EINTR == errno)
+			continue;
+		if (n <= 0)
+			return false;
+		pos += n;
+	}
+	memmove(client->out.data, client->out.data + pos, client->out.len - pos);
+	client->out.len -= pos;
+	return true;
+}
+
+static bool remote_handle(struct RemoteClient *client, uint16_t type,
+	const char *payload, uint32_t length)
+{
+	if (REMOTE_HELLO == type)
+	{
+		free(client->name);
+		client->name = strndup(payload, length);
+		printf("remote node %s connected\n", client->name);
+		uint32_t version = REMOTE_VERSION;
+		remote_append(client, REMOTE_HELLO, &version, sizeof(version));
+		return true;
+	}
+	if (!client->name)
+	{
+		fprintf(stderr, "remote node did not introduce itself\n");
+		return false;
+	}
+
+	switch (type)
+	{
+	case REMOTE_FILTER:
+		client->filters_num = length / sizeof(struct can_filter);
+		if (client->filters_num > REMOTE_MAX_FILTERS)
+		{
+			fprintf(stderr, "remote node %s: too many filters\n", client->name);
+			return false;
+		}
+		memcpy(client->filters, payload, client->filters_num * sizeof(struct can_filter));
+		break;
+	case REMOTE_FRAMES:
+		// the payload may be unaligned in the input buffer
+		for (uint32_t pos = 0; pos + sizeof(struct RemoteFrame) <= length; )
+		{
+			struct RemoteFrame batch[REMOTE_TX_BATCH];
+			int num = 0;
+			while (num < REMOTE_TX_BATCH && pos + sizeof(struct RemoteFrame) <= length)
+			{
+				memcpy(&batch[num++], payload + pos, sizeof(struct RemoteFrame));
+				pos += sizeof(struct RemoteFrame);
+			}
+			remote_transmit(batch, num);
+		}
+		break;
+	default:
+		fprintf(stderr, "remote node %s: unknown message type %u\n", client->name, type);
+		return false;
+	}
+	return true;
+}
+
+// sends a batch of frames with a single system call, or queues it in the ring
+static void remote_transmit(const struct RemoteFrame *frames, int num)
+{
+	// queued behind frames emitted by Lua nodes, keeping the bus order
+	if (uring_active())
+	{
+		for (int i = 0; i < num; ++i)
+		{
+			if (frames[i].mtu == CAN_MTU || frames[i].mtu == CANFD_MTU)
+				uring_emit(&frames[i].frame, frames[i].mtu);
+		}
+		return;
+	}
+
+	struct mmsghdr msgs[REMOTE_TX_BATCH];
+	struct iovec iovs[REMOTE_TX_BATCH];
+	int n = 0;
+	for (int i = 0; i < num; ++i)
+	{
+		if (frames[i].mtu != CAN_MTU && frames[i].mtu != CANFD_MTU)
+			continue;
+		iovs[n].iov_base = (void *)&frames[i].frame;
+		iovs[n].iov_len = frames[i].mtu;
+		memset(&msgs[n], 0, sizeof(msgs[n]));
+		msgs[n].msg_hdr.msg_iov = &iovs[n];
+		msgs[n].msg_hdr.msg_iovlen = 1;
+		++n;
+	}
+
+	int sent = 0;
+	while (sent < n)
+	{
+		int ret = sendmmsg(s, msgs + sent, n - sent, 0);
+		if (ret <= 0)
+		{
+			fprintf(stderr, "critical: cannot send a message\n");
+			break;
+		}
+		sent += ret;
+	}
+}
+
+static void remote_close(int idx)
+{
+	struct RemoteClient *client = &clients[idx];
+	if (client->name)
+		printf("remote node %s disconnected\n", client->name);
+	close(client->fd);
+	free(client->name);
+	free(client->in.data);
+	free(client->out.data);
+	clients[idx] = clients[--clients_num];
+}
+
+static bool remote_match(const struct RemoteClient *client, canid_t id)
+{
+	if (client->filters_num < 0)
+		return true;
+	for (int i = 0; i < client->filters_num; ++i)
+	{
+		const struct can_filter *f = &client->filters[i];
+		bool match = (id & f->can_mask) == (f->can_id & f->can_mask);
+		if (f->can_id & CAN_INV_FILTER)
+			match = !match;
+		if (match)
+			return true;
+	}
+	return false;
+}
+
+static bool remote_reserve(struct RemoteBuffer *buf, size_t len)
+{
+	if (buf->len + len <= buf->cap)
+		return true;
+	size_t cap = buf->cap ? buf->cap : 4096;
+	while (cap < buf->len + len)
+		cap *= 2;
+	char *data = (char *)realloc(buf->data, cap);
+	if (!data)
+		return false;
+	buf->data = data;
+	buf->cap = cap;
+	return true;
+}
+
+static void remote_append(struct RemoteClient *client, uint16_t type,
+	const void *payload, uint32_t length)
+{
+	if (!remote_reserve(&client->out, sizeof(struct RemoteHeader) + length))
+		return;
+	struct RemoteHeader hdr = { type, 0, length };
+	memcpy(client->out.data + client->out.len, &hdr, sizeof(hdr));
+	client->out.len += sizeof(hdr);
+	if (length)
+		memcpy(client->out.data + client->out.len, payload, length);
+	client->out.len += length;
+	// anything appended after it would break the frame batch
+	client->frames_open = false;
+}
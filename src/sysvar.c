@@ -0,0 +1,449 @@
+/*
+	Bulwa CAN Simulator
+	Copyright (C) 2024 Szymon Morawski
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "global.h"
+
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+
+/*
+ * All variables live in a single region: this header, an array
+ * of struct SysvarEntry and the values, each 8 byte aligned at
+ * offset bytes from the start of the region. If the store is
+ * exported, the region is a POSIX shared memory object, so that
+ * external tools can find variables by name and access them.
+ *
+ * Every entry is guarded by a sequence lock: a writer moves seq
+ * from an even to an odd value (compare and swap), updates the
+ * value and increments seq again; a reader retries as long as seq
+ * is odd or has changed while copying the value. An external writer
+ * may die in the middle of an update, so seq staying odd for longer
+ * than SYSVAR_STALE_NS is taken as abandoned and moved on to the next
+ * even value, rather than blocking the main loop forever.
+ */
+#define SYSVAR_VERSION	1
+#define SYSVAR_SPINS	1000
+#define SYSVAR_STALE_NS	100000000ULL
+
+struct SysvarShmHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t count;
+	uint32_t size;
+};
+
+struct SysvarEntry
+{
+	char name[SYSVAR_NAME_MAX];
+	uint32_t type;
+	uint32_t capacity;
+	uint32_t offset;
+	uint32_t length;
+	uint32_t seq;
+	uint32_t reserved;
+};
+
+struct SysvarState
+{
+	uint32_t last_seq;		// seq after the last write noticed
+	bool pending;
+	int *subscribers;
+	int subscribers_num;
+};
+
+static const char sysvar_magic[4] = { 'B', 'L', 'W', 'V' };
+
+static char *region = NULL;
+static size_t region_size = 0;
+static char *shm_name = NULL;
+static struct SysvarEntry *entries = NULL;
+static struct SysvarState *states = NULL;
+static int vars_num = 0;
+static int vars_defined = 0;
+
+// changes are collected in one list while the other one is delivered
+static int *pending = NULL;
+static int pending_num = 0;
+static int *delivered = NULL;
+
+static uint32_t sysvar_wait_writer(struct SysvarEntry *entry, uint32_t seq);
+static uint32_t sysvar_write_begin(struct SysvarEntry *entry);
+static void sysvar_write_end(struct SysvarEntry *entry, int var, uint32_t seq);
+static void sysvar_read(int var, void *value, uint32_t *length);
+static void sysvar_notify(int var);
+
+// sizes are the capacities of the variables in the order of definition
+int sysvar_init(int num, const size_t *sizes, const char *name)
+{
+	sysvar_deinit();
+	if (num <= 0)
+		return RC_OK;
+
+	size_t size = sizeof(struct SysvarShmHeader) + num * sizeof(struct SysvarEntry);
+	for (int i = 0; i < num; ++i)
+		size += (sizes[i] + 7) & ~(size_t)7;
+
+	if (name)
+	{
+		// another simulator may be using an existing object
+		int fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+		if (fd < 0 && EEXIST == errno)
+		{
+			fprintf(stderr, "shared memory object %s exists already, "
+				"remove it if no other simulator is using it\n", name);
+			return RC_INIT;
+		}
+		if (fd < 0)
+		{
+			fprintf(stderr, "cannot open shared memory object %s\n", name);
+			return RC_INIT;
+		}
+		void *ptr = MAP_FAILED;
+		if (0 == ftruncate(fd, size))
+			ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (MAP_FAILED == ptr)
+		{
+			fprintf(stderr, "cannot map shared memory object %s\n", name);
+			shm_unlink(name);
+			return RC_INIT;
+		}
+		region = (char *)ptr;
+		shm_name = strdup(name);
+	}
+	else
+	{
+		region = (char *)calloc(1, size);
+	}
+	region_size = size;
+
+	entries = (struct SysvarEntry *)(region + sizeof(struct SysvarShmHeader));
+	states = (struct SysvarState *)calloc(num, sizeof(struct SysvarState));
+	pending = (int *)malloc(num * sizeof(int));
+	delivered = (int *)malloc(num * sizeof(int));
+	vars_num = num;
+	vars_defined = 0;
+
+	struct SysvarShmHeader *hdr = (struct SysvarShmHeader *)region;
+	hdr->version = SYSVAR_VERSION;
+	hdr->count = num;
+	hdr->size = size;
+	return RC_OK;
+}
+
+void sysvar_deinit(void)
+{
+	for (int i = 0; i < vars_num; ++i)
+		free(states[i].subscribers);
+	free(states);
+	free(pending);
+	free(delivered);
+	if (shm_name)
+	{
+		munmap(region, region_size);
+		shm_unlink(shm_name);
+		free(shm_name);
+	}
+	else
+	{
+		free(region);
+	}
+	region = NULL;
+	region_size = 0;
+	shm_name = NULL;
+	entries = NULL;
+	states = NULL;
+	pending = NULL;
+	delivered = NULL;
+	pending_num = 0;
+	vars_num = 0;
+	vars_defined = 0;
+}
+
+// returns the handle of a new variable, or -1 on failure
+int sysvar_define(const char *name, enum SysvarType type, size_t capacity)
+{
+	if (vars_defined >= vars_num || strlen(name) >= SYSVAR_NAME_MAX)
+		return -1;
+	if (sysvar_find(name) >= 0)
+		return -1;
+
+	int var = vars_defined;
+	struct SysvarEntry *entry = &entries[var];
+	uint32_t offset = sizeof(struct SysvarShmHeader) + vars_num * sizeof(struct SysvarEntry);
+	if (var > 0)
+		offset = entries[var - 1].offset + ((entries[var - 1].capacity + 7) & ~(uint32_t)7);
+
+	strcpy(entry->name, name);
+	entry->type = type;
+	entry->capacity = capacity;
+	entry->offset = offset;
+	entry->length = (SV_BYTES == type) ? 0 : capacity;
+	++vars_defined;
+
+	// the store is ready for external tools once all variables are in place
+	if (vars_defined == vars_num)
+	{
+		struct SysvarShmHeader *hdr = (struct SysvarShmHeader *)region;
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+		memcpy(hdr->magic, sysvar_magic, sizeof(hdr->magic));
+	}
+	return var;
+}
+
+int sysvar_find(const char *name)
+{
+	for (int i = 0; i < vars_defined; ++i)
+	{
+		if (!strcmp(entries[i].name, name))
+			return i;
+	}
+	return -1;
+}
+
+bool sysvar_valid(int var)
+{
+	return var >= 0 && var < vars_defined;
+}
+
+const char *sysvar_get_name(int var)
+{
+	return entries[var].name;
+}
+
+enum SysvarType sysvar_get_type(int var)
+{
+	return (enum SysvarType)entries[var].type;
+}
+
+size_t sysvar_get_capacity(int var)
+{
+	return entries[var].capacity;
+}
+
+lua_Integer sysvar_get_int(int var)
+{
+	int64_t value;
+	sysvar_read(var, &value, NULL);
+	return value;
+}
+
+lua_Number sysvar_get_float(int var)
+{
+	double value;
+	sysvar_read(var, &value, NULL);
+	return value;
+}
+
+// value must hold at least the capacity of the variable
+size_t sysvar_get_bytes(int var, void *value)
+{
+	uint32_t length;
+	sysvar_read(var, value, &length);
+	return length;
+}
+
+void sysvar_set_int(int var, lua_Integer value)
+{
+	struct SysvarEntry *entry = &entries[var];
+	int64_t *ptr = (int64_t *)(region + entry->offset);
+	uint32_t seq = sysvar_write_begin(entry);
+	bool changed = *ptr != value;
+	*ptr = value;
+	sysvar_write_end(entry, var, seq);
+	if (changed)
+		sysvar_notify(var);
+}
+
+void sysvar_set_float(int var, lua_Number value)
+{
+	struct SysvarEntry *entry = &entries[var];
+	double *ptr = (double *)(region + entry->offset);
+	uint32_t seq = sysvar_write_begin(entry);
+	bool changed = memcmp(ptr, &(double){ value }, sizeof(double));
+	*ptr = value;
+	sysvar_write_end(entry, var, seq);
+	if (changed)
+		sysvar_notify(var);
+}
+
+// length must not exceed the capacity of the variable
+void sysvar_set_bytes(int var, const void *value, size_t length)
+{
+	struct SysvarEntry *entry = &entries[var];
+	char *ptr = region + entry->offset;
+	uint32_t seq = sysvar_write_begin(entry);
+	bool changed = entry->length != length || memcmp(ptr, value, length);
+	memcpy(ptr, value, length);
+	entry->length = length;
+	sysvar_write_end(entry, var, seq);
+	if (changed)
+		sysvar_notify(var);
+}
+
+int sysvar_subscribe(int var, int node_id)
+{
+	struct SysvarState *state = &states[var];
+	for (int i = 0; i < state->subscribers_num; ++i)
+	{
+		if (node_id == state->subscribers[i])
+			return RC_OK;
+	}
+	int *subscribers = (int *)realloc(state->subscribers,
+		(state->subscribers_num + 1) * sizeof(int));
+	if (!subscribers)
+		return RC_MEMORY;
+	subscribers[state->subscribers_num++] = node_id;
+	state->subscribers = subscribers;
+	return RC_OK;
+}
+
+const int *sysvar_get_subscribers(int var, int *num)
+{
+	*num = states[var].subscribers_num;
+	return states[var].subscribers;
+}
+
+/*
+ * Returns variables changed since the previous call, including
+ * writes done by external tools. Changes made while they are being
+ * delivered are returned by the next call.
+ */
+const int *sysvar_get_changes(int *num)
+{
+	if (shm_name)
+	{
+		for (int i = 0; i < vars_defined; ++i)
+		{
+			uint32_t seq = __atomic_load_n(&entries[i].seq, __ATOMIC_ACQUIRE);
+			if (!(seq & 1) && seq != states[i].last_seq)
+			{
+				states[i].last_seq = seq;
+				sysvar_notify(i);
+			}
+		}
+	}
+
+	int *changes = pending;
+	*num = pending_num;
+	pending = delivered;
+	delivered = changes;
+	pending_num = 0;
+	for (int i = 0; i < *num; ++i)
+		states[changes[i]].pending = false;
+	return changes;
+}
+
+bool sysvar_changes_pending(void)
+{
+	return pending_num > 0;
+}
+
+static inline unsigned long long sysvar_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// waits for seq to become even, taking over an abandoned update
+static uint32_t sysvar_wait_writer(struct SysvarEntry *entry, uint32_t seq)
+{
+	unsigned long long start = 0;
+	for (int spins = 0; seq & 1; ++spins)
+	{
+		if (spins >= SYSVAR_SPINS)
+		{
+			unsigned long long now = sysvar_now();
+			if (!start)
+				start = now;
+			if (now - start >= SYSVAR_STALE_NS)
+			{
+				fprintf(stderr, "warning: sysvar %s: update abandoned by a writer, taking over\n",
+					entry->name);
+				if (__atomic_compare_exchange_n(&entry->seq, &seq, seq + 1,
+					false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+				{
+					return seq + 1;
+				}
+				start = 0;
+				spins = 0;
+				continue;
+			}
+			sched_yield();
+		}
+		uint32_t next = __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE);
+		if (next != seq)
+		{
+			// another update, the writer is alive
+			start = 0;
+			spins = 0;
+		}
+		seq = next;
+	}
+	return seq;
+}
+
+static uint32_t sysvar_write_begin(struct SysvarEntry *entry)
+{
+	uint32_t seq = __atomic_load_n(&entry->seq, __ATOMIC_RELAXED);
+	do
+	{
+		seq = sysvar_wait_writer(entry, seq);
+	} while (!__atomic_compare_exchange_n(&entry->seq, &seq, seq + 1,
+		true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	return seq + 1;
+}
+
+static void sysvar_write_end(struct SysvarEntry *entry, int var, uint32_t seq)
+{
+	__atomic_store_n(&entry->seq, seq + 1, __ATOMIC_RELEASE);
+	// own writes are notified directly, not by polling
+	states[var].last_seq = seq + 1;
+}
+
+static void sysvar_read(int var, void *value, uint32_t *length)
+{
+	struct SysvarEntry *entry = &entries[var];
+	const char *ptr = region + entry->offset;
+	uint32_t seq;
+	do
+	{
+		seq = sysvar_wait_writer(entry, __atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE));
+		uint32_t len = entry->length;
+		if (len > entry->capacity)
+			len = entry->capacity;
+		memcpy(value, ptr, len);
+		if (length)
+			*length = len;
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (seq != __atomic_load_n(&entry->seq, __ATOMIC_RELAXED));
+}
+
+static void sysvar_notify(int var)
+{
+	if (states[var].pending || !states[var].subscribers_num)
+		return;
+	states[var].pending = true;
+	pending[pending_num++] = var;
+}
@@ -0,0 +1,550 @@
+/*
+	Bulwa CAN Simulator
+	Copyright (C) 2024 Szymon Morawski
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+#include "global.h"
+
+#include <errno.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ * io_uring backend of the main loop, driven by raw system calls.
+ *
+ * The CAN socket is read by a single multishot recvmsg, picking
+ * buffers from a provided buffer ring. Every buffer holds struct
+ * io_uring_recvmsg_out, the control messages (timestamps) and the
+ * frame, it goes back to the ring once uring_recvmsg has copied
+ * the frame out.
+ *
+ * Emitted frames are copied into transmit slots and sent in batches
+ * when the loop waits. Sends of a batch are linked to keep them in
+ * order, and only the last one (or a failed one) posts a completion.
+ * The next batch goes out once that completion has come, keeping the
+ * order of frames across batches as well. A failed send, e.g. with
+ * ENOBUFS when the TX queue of the interface is full, cancels the rest
+ * of its batch. That frame is dropped like on the poll path, and the
+ * cancelled ones go out with the next batch; the batch number in
+ * user_data tells late completions of cancelled sends apart.
+ *
+ * The loop timeout is an absolute timeout request in the same ring,
+ * kept armed across waits and moved only if it has to fire earlier.
+ * Remote nodes keep using poll, the ring descriptor is polled among
+ * their sockets then.
+ */
+#define URING_ENTRIES		256
+#define URING_CQ_ENTRIES	1024
+#define URING_BUFFERS		256	// power of two
+#define URING_BUFFER_SIZE	256
+#define URING_TX_SLOTS		256
+#define URING_BGID		0
+
+// user_data is the kind of a request in the upper half and a sequence number,
+// sends also carry the number of their batch in the topmost bits
+#define UD_RX			(1ULL << 32)
+#define UD_TIMEOUT		(2ULL << 32)
+#define UD_TIMEOUT_UPDATE	(3ULL << 32)
+#define UD_TX			(4ULL << 32)
+#define UD_TX_LAST		(8ULL << 32)	// flag of the last send of a batch
+#define UD_KIND(ud)		((ud) & (7ULL << 32))
+#define UD_BATCH_MASK		0xfffffff
+#define UD_BATCH(ud)		((uint32_t)((ud) >> 36) & UD_BATCH_MASK)
+
+struct UringSlot
+{
+	struct canfd_frame frame;
+	int mtu;
+};
+
+struct UringReceived
+{
+	int32_t res;			// bytes in the buffer or -errno
+	uint16_t bid;
+};
+
+static int ring_fd = -1;
+static int can_fd = -1;
+
+static void *ring_ptr = MAP_FAILED;
+static size_t ring_size;
+static struct io_uring_sqe *sqes = MAP_FAILED;
+static size_t sqes_size;
+static unsigned *sq_khead;
+static unsigned *sq_ktail;
+static unsigned sq_mask;
+static unsigned sq_entries;
+static unsigned sq_tail;
+static unsigned *cq_khead;
+static unsigned *cq_ktail;
+static unsigned cq_mask;
+static struct io_uring_cqe *cqes;
+
+static struct io_uring_buf_ring *buf_ring = MAP_FAILED;
+static char *buffers = NULL;
+static unsigned short buf_tail;
+
+// receiving
+static struct msghdr rx_msg;
+static bool rx_armed;
+static struct UringReceived received[2 * URING_BUFFERS];
+static unsigned received_head;
+static unsigned received_tail;
+
+// transmitting
+static struct UringSlot *tx_slots = NULL;
+static uint32_t tx_head;		// oldest slot not sent yet
+static uint32_t tx_sent;		// end of the batch in flight
+static uint32_t tx_tail;		// next free slot
+static uint32_t tx_batch;		// number of the batch in flight
+
+static bool timeout_armed;
+static unsigned long long timeout_deadline;
+static struct __kernel_timespec timeout_ts;
+
+static void uring_cleanup(void);
+static struct io_uring_sqe *uring_get_sqe(void);
+static int uring_enter(unsigned min_complete, unsigned flags);
+static void uring_reap(void);
+static void uring_complete(const struct io_uring_cqe *cqe);
+static void uring_flush_tx(void);
+static void uring_provide(unsigned short bid);
+static void uring_arm_rx(void);
+static bool uring_arm_timeout(int timeout);
+
+// fd is the CAN socket, returns RC_SOCKET if the kernel cannot do it
+int uring_init(int fd)
+{
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL;
+	params.cq_entries = URING_CQ_ENTRIES;
+	ring_fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+	if (ring_fd < 0)
+		return RC_SOCKET;
+	can_fd = fd;
+
+	// a single mapping of both rings, available since the provided
+	// buffer rings used below anyway
+	if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+	{
+		uring_cleanup();
+		return RC_SOCKET;
+	}
+	size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	ring_size = sq_size > cq_size ? sq_size : cq_size;
+	ring_ptr = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring_fd, IORING_OFF_SQ_RING);
+	sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		ring_fd, IORING_OFF_SQES);
+	if (MAP_FAILED == ring_ptr || MAP_FAILED == sqes)
+	{
+		uring_cleanup();
+		return RC_SOCKET;
+	}
+
+	char *ring = (char *)ring_ptr;
+	sq_khead = (unsigned *)(ring + params.sq_off.head);
+	sq_ktail = (unsigned *)(ring + params.sq_off.tail);
+	sq_mask = *(unsigned *)(ring + params.sq_off.ring_mask);
+	sq_entries = params.sq_entries;
+	sq_tail = *sq_ktail;
+	unsigned *sq_array = (unsigned *)(ring + params.sq_off.array);
+	for (unsigned i = 0; i < sq_entries; ++i)
+		sq_array[i] = i;
+	cq_khead = (unsigned *)(ring + params.cq_off.head);
+	cq_ktail = (unsigned *)(ring + params.cq_off.tail);
+	cq_mask = *(unsigned *)(ring + params.cq_off.ring_mask);
+	cqes = (struct io_uring_cqe *)(ring + params.cq_off.cqes);
+
+	// provided buffers for received frames
+	buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf),
+		PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	buffers = (char *)malloc(URING_BUFFERS * URING_BUFFER_SIZE);
+	tx_slots = (struct UringSlot *)malloc(URING_TX_SLOTS * sizeof(struct UringSlot));
+	if (MAP_FAILED == buf_ring || !buffers || !tx_slots)
+	{
+		uring_cleanup();
+		return RC_MEMORY;
+	}
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)buf_ring;
+	reg.ring_entries = URING_BUFFERS;
+	reg.bgid = URING_BGID;
+	if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+	{
+		uring_cleanup();
+		return RC_SOCKET;
+	}
+	buf_tail = 0;
+	for (int i = 0; i < URING_BUFFERS; ++i)
+		uring_provide(i);
+
+	// room for the same control messages the poll path asks for
+	memset(&rx_msg, 0, sizeof(rx_msg));
+	rx_msg.msg_controllen = RX_CONTROL_SIZE;
+	_Static_assert(sizeof(struct io_uring_recvmsg_out) + RX_CONTROL_SIZE +
+		sizeof(struct canfd_frame) <= URING_BUFFER_SIZE, "buffer too small");
+
+	received_head = received_tail = 0;
+	tx_head = tx_sent = tx_tail = 0;
+	tx_batch = 0;
+	timeout_armed = false;
+
+	/*
+	 * Kernels without multishot recvmsg fail the request right away,
+	 * those have no skipped completions either, which sends rely on.
+	 */
+	uring_arm_rx();
+	if (uring_enter(0, IORING_ENTER_GETEVENTS) < 0)
+	{
+		uring_cleanup();
+		return RC_SOCKET;
+	}
+	uring_reap();
+	if (!rx_armed)
+	{
+		uring_cleanup();
+		return RC_SOCKET;
+	}
+	return RC_OK;
+}
+
+// queued frames get one more chance to go out, the rest is dropped
+void uring_deinit(void)
+{
+	if (ring_fd < 0)
+		return;
+	uring_enter(0, 0);
+	uring_cleanup();
+}
+
+bool uring_active(void)
+{
+	return ring_fd >= 0;
+}
+
+/*
+ * Counterpart of poll for the main loop, fds[0] stands for the CAN socket
+ * and gets POLLIN once received frames are waiting for uring_recvmsg, the
+ * others (remote nodes) are polled along with the ring. Queued sends go out
+ * before waiting.
+ */
+int uring_wait(struct pollfd *fds, int num, int timeout)
+{
+	if (!rx_armed)
+		uring_arm_rx();
+	if (received_head != received_tail)
+		timeout = 0;
+	bool armed = uring_arm_timeout(timeout);
+
+	// without a timeout request, poll has to keep the time
+	int ready = 0;
+	if (num > 1 || (timeout && !armed))
+	{
+		uring_enter(0, IORING_ENTER_GETEVENTS);
+		uring_reap();
+		if (received_head != received_tail)
+			timeout = 0;
+		fds[0].fd = ring_fd;
+		fds[0].events = POLLIN;
+		// the timeout request wakes the ring, so poll may wait forever
+		ready = poll(fds, num, !timeout ? 0 : armed ? -1 : timeout);
+		fds[0].fd = can_fd;
+		if (ready < 0)
+			ready = 0;
+		else if (ready > 0 && fds[0].revents)
+			--ready;
+		uring_enter(0, IORING_ENTER_GETEVENTS);
+	}
+	else
+	{
+		uring_enter(timeout ? 1 : 0, IORING_ENTER_GETEVENTS);
+	}
+	uring_reap();
+
+	fds[0].revents = received_head != received_tail ? POLLIN : 0;
+	if (fds[0].revents)
+		++ready;
+	return ready;
+}
+
+/*
+ * Takes the next received frame like recvmsg does, msg provides a single
+ * iovec and room for control messages. Returns 0 if there are no more
+ * frames, -1 with errno set if the socket failed.
+ */
+int uring_recvmsg(struct msghdr *msg)
+{
+	if (received_head == received_tail)
+		return 0;
+	struct UringReceived rx = received[received_head++ % (2 * URING_BUFFERS)];
+	if (rx.res < 0)
+	{
+		errno = -rx.res;
+		return -1;
+	}
+
+	const char *buf = buffers + rx.bid * URING_BUFFER_SIZE;
+	struct io_uring_recvmsg_out out;
+	memcpy(&out, buf, sizeof(out));
+	const char *control = buf + sizeof(out) + rx_msg.msg_namelen;
+	const char *payload = control + rx_msg.msg_controllen;
+
+	size_t controllen = out.controllen;
+	if (controllen > msg->msg_controllen)
+		controllen = msg->msg_controllen;
+	if (controllen)
+		memcpy(msg->msg_control, control, controllen);
+	msg->msg_controllen = controllen;
+	msg->msg_flags = out.flags;
+
+	size_t len = out.payloadlen;
+	size_t stored = rx.res > payload - buf ? rx.res - (payload - buf) : 0;
+	if (len > stored)
+		len = stored;
+	if (len > msg->msg_iov[0].iov_len)
+		len = msg->msg_iov[0].iov_len;
+	memcpy(msg->msg_iov[0].iov_base, payload, len);
+
+	uring_provide(rx.bid);
+	return len;
+}
+
+// queues a frame, it is sent once the main loop waits
+int uring_emit(const struct canfd_frame *frame, int mtu)
+{
+	// all slots taken, wait for the batch in flight to complete
+	while (tx_tail - tx_head >= URING_TX_SLOTS)
+	{
+		if (uring_enter(1, IORING_ENTER_GETEVENTS) < 0 && EINTR != errno)
+		{
+			fprintf(stderr, "critical: cannot send a message\n");
+			return -1;
+		}
+		uring_reap();
+	}
+	struct UringSlot *slot = &tx_slots[tx_tail % URING_TX_SLOTS];
+	memcpy(&slot->frame, frame, mtu);
+	slot->mtu = mtu;
+	++tx_tail;
+	return 0;
+}
+
+static void uring_cleanup(void)
+{
+	// closing the ring cancels whatever is in flight
+	if (ring_fd >= 0)
+		close(ring_fd);
+	ring_fd = -1;
+	if (MAP_FAILED != ring_ptr)
+		munmap(ring_ptr, ring_size);
+	ring_ptr = MAP_FAILED;
+	if (MAP_FAILED != sqes)
+		munmap(sqes, sqes_size);
+	sqes = MAP_FAILED;
+	if (MAP_FAILED != buf_ring)
+		munmap(buf_ring, URING_BUFFERS * sizeof(struct io_uring_buf));
+	buf_ring = MAP_FAILED;
+	free(buffers);
+	buffers = NULL;
+	free(tx_slots);
+	tx_slots = NULL;
+	rx_armed = false;
+}
+
+// returns NULL if the submission queue is full even after submitting it
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+	if (sq_tail - __atomic_load_n(sq_khead, __ATOMIC_ACQUIRE) >= sq_entries)
+	{
+		uring_enter(0, 0);
+		if (sq_tail - __atomic_load_n(sq_khead, __ATOMIC_ACQUIRE) >= sq_entries)
+			return NULL;
+	}
+	struct io_uring_sqe *sqe = &sqes[sq_tail++ & sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+// submits queued requests along with the next batch of sends
+static int uring_enter(unsigned min_complete, unsigned flags)
+{
+	uring_flush_tx();
+	__atomic_store_n(sq_ktail, sq_tail, __ATOMIC_RELEASE);
+	unsigned to_submit = sq_tail - __atomic_load_n(sq_khead, __ATOMIC_ACQUIRE);
+	int ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+	if (ret < 0 && EINTR != errno && EBUSY != errno && EAGAIN != errno)
+		fprintf(stderr, "io_uring_enter error %d\n", errno);
+	return ret;
+}
+
+static void uring_reap(void)
+{
+	unsigned head = *cq_khead;
+	unsigned tail = __atomic_load_n(cq_ktail, __ATOMIC_ACQUIRE);
+	while (head != tail)
+	{
+		uring_complete(&cqes[head & cq_mask]);
+		++head;
+	}
+	__atomic_store_n(cq_khead, head, __ATOMIC_RELEASE);
+}
+
+static void uring_complete(const struct io_uring_cqe *cqe)
+{
+	switch (UD_KIND(cqe->user_data))
+	{
+	case UD_RX:
+		if (!(cqe->flags & IORING_CQE_F_MORE))
+			rx_armed = false;
+		// out of buffers, uring_wait arms the request again
+		if (-ENOBUFS == cqe->res)
+			break;
+		if (received_tail - received_head < 2 * URING_BUFFERS)
+		{
+			struct UringReceived *rx = &received[received_tail++ % (2 * URING_BUFFERS)];
+			rx->res = cqe->res;
+			rx->bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+			if (cqe->res >= 0 && !(cqe->flags & IORING_CQE_F_BUFFER))
+				rx->res = -EIO;
+		}
+		break;
+	case UD_TIMEOUT:
+		timeout_armed = false;
+		break;
+	case UD_TIMEOUT_UPDATE:
+		// the timeout has fired meanwhile
+		break;
+	case UD_TX:
+		// sends of a batch complete in order, a failed one ends the
+		// batch early; depending on the kernel, the cancelled ones
+		// following it may still complete and are ignored then
+		if (UD_BATCH(cqe->user_data) != tx_batch)
+			break;
+		if (cqe->res < 0)
+			fprintf(stderr, "critical: cannot send a message\n");
+		if (cqe->res < 0 || (cqe->user_data & UD_TX_LAST))
+		{
+			tx_head = tx_sent = (uint32_t)cqe->user_data + 1;
+			tx_batch = (tx_batch + 1) & UD_BATCH_MASK;
+		}
+		break;
+	}
+}
+
+static void uring_flush_tx(void)
+{
+	if (tx_head != tx_sent || tx_sent == tx_tail)
+		return;
+	struct io_uring_sqe *last = NULL;
+	while (tx_sent != tx_tail)
+	{
+		if (sq_tail - __atomic_load_n(sq_khead, __ATOMIC_ACQUIRE) >= sq_entries)
+			break;
+		struct io_uring_sqe *sqe = uring_get_sqe();
+		struct UringSlot *slot = &tx_slots[tx_sent % URING_TX_SLOTS];
+		sqe->opcode = IORING_OP_SEND;
+		sqe->fd = can_fd;
+		sqe->addr = (uintptr_t)&slot->frame;
+		sqe->len = slot->mtu;
+		sqe->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+		sqe->user_data = UD_TX | (uint64_t)tx_batch << 36 | tx_sent;
+		++tx_sent;
+		last = sqe;
+	}
+	if (last)
+	{
+		// the last send must not link to whatever comes next,
+		// its completion frees the slots of the whole batch
+		last->flags &= ~(IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS);
+		last->user_data |= UD_TX_LAST;
+	}
+}
+
+static void uring_provide(unsigned short bid)
+{
+	struct io_uring_buf *buf = &buf_ring->bufs[buf_tail & (URING_BUFFERS - 1)];
+	buf->addr = (uintptr_t)(buffers + bid * URING_BUFFER_SIZE);
+	buf->len = URING_BUFFER_SIZE;
+	buf->bid = bid;
+	++buf_tail;
+	__atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_arm_rx(void)
+{
+	struct io_uring_sqe *sqe = uring_get_sqe();
+	if (!sqe)
+		return;
+	sqe->opcode = IORING_OP_RECVMSG;
+	sqe->fd = can_fd;
+	sqe->addr = (uintptr_t)&rx_msg;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = UD_RX;
+	rx_armed = true;
+}
+
+// timeout in milliseconds, 0 for none, returns false if no timeout is armed
+static bool uring_arm_timeout(int timeout)
+{
+	if (timeout <= 0)
+		return false;
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	unsigned long long deadline = (unsigned long long)now.tv_sec * 1000000000 +
+		now.tv_nsec + (unsigned long long)timeout * 1000000;
+	// firing too early only costs an idle iteration
+	if (timeout_armed && timeout_deadline <= deadline)
+		return true;
+
+	// an armed timeout firing later than required is no timeout
+	struct io_uring_sqe *sqe = uring_get_sqe();
+	if (!sqe)
+		return false;
+	timeout_ts.tv_sec = deadline / 1000000000;
+	timeout_ts.tv_nsec = deadline % 1000000000;
+	if (timeout_armed)
+	{
+		sqe->opcode = IORING_OP_TIMEOUT_REMOVE;
+		sqe->addr = UD_TIMEOUT;
+		sqe->addr2 = (uintptr_t)&timeout_ts;
+		sqe->timeout_flags = IORING_TIMEOUT_UPDATE | IORING_TIMEOUT_ABS;
+		sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+		sqe->user_data = UD_TIMEOUT_UPDATE;
+	}
+	else
+	{
+		// len is the number of timespecs, off the number of completions
+		// ending the timeout early, none for a pure timeout
+		sqe->opcode = IORING_OP_TIMEOUT;
+		sqe->addr = (uintptr_t)&timeout_ts;
+		sqe->len = 1;
+		sqe->off = 0;
+		sqe->timeout_flags = IORING_TIMEOUT_ABS;
+		sqe->user_data = UD_TIMEOUT;
+	}
+	timeout_armed = true;
+	timeout_deadline = deadline;
+	return true;
+}
@@ -0,0 +1,948 @@
+/*
+	Bulwa CAN Simulator
+	Copyright (C) 2024 Szymon Morawski
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <https://www.gnu.org/licenses/>.
+*/
+
+/*
+ * bulwa-diagc - compiles ODX and CDD descriptions of ECUs into
+ * a diagnostic database loaded by the simulator (see src/diagdb.h).
+ *
+ * usage: bulwa-diagc -o output.bdb input.odx [input.cdd ...]
+ *
+ * Several inputs are merged, references between them are resolved
+ * (ODX layers are often split into a number of files).
+ */
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <expat.h>
+
+#include "../src/diagdb.h"
+
+struct XmlNode
+{
+	char *name;
+	char **attrs;			// name and value pairs, NULL terminated
+	char *text;
+	size_t text_len;
+	struct XmlNode *parent;
+	struct XmlNode *child;
+	struct XmlNode *last;
+	struct XmlNode *next;
+};
+
+struct XmlParser
+{
+	struct XmlNode *root;
+	struct XmlNode *current;
+};
+
+// elements with an ID (ODX) or id (CDD) attribute
+struct IdEntry
+{
+	const char *id;
+	struct XmlNode *node;
+};
+
+struct DidEntry
+{
+	struct DiagDbDid did;
+	bool defined;
+};
+
+struct Builder
+{
+	struct DidEntry *dids;		// 65536 entries indexed by identifier
+	int dids_num;
+	struct DiagDbParam *params;
+	size_t params_num;
+	size_t params_cap;
+	bool services[256];
+	uint32_t service_names[256];
+	uint8_t subfunctions[256][32];	// bitmaps
+	bool sessions[256];
+	uint32_t session_names[256];
+	char *strings;
+	size_t strings_len;
+	size_t strings_cap;
+};
+
+static struct IdEntry *ids = NULL;
+static size_t ids_size = 0;
+static size_t ids_num = 0;
+
+// names of the services defined by ISO 14229-1
+static const char *const uds_services[256] = {
+	[0x10] = "DiagnosticSessionControl",
+	[0x11] = "ECUReset",
+	[0x14] = "ClearDiagnosticInformation",
+	[0x19] = "ReadDTCInformation",
+	[0x22] = "ReadDataByIdentifier",
+	[0x23] = "ReadMemoryByAddress",
+	[0x24] = "ReadScalingDataByIdentifier",
+	[0x27] = "SecurityAccess",
+	[0x28] = "CommunicationControl",
+	[0x29] = "Authentication",
+	[0x2A] = "ReadDataByPeriodicIdentifier",
+	[0x2C] = "DynamicallyDefineDataIdentifier",
+	[0x2E] = "WriteDataByIdentifier",
+	[0x2F] = "InputOutputControlByIdentifier",
+	[0x31] = "RoutineControl",
+	[0x34] = "RequestDownload",
+	[0x35] = "RequestUpload",
+	[0x36] = "TransferData",
+	[0x37] = "RequestTransferExit",
+	[0x38] = "RequestFileTransfer",
+	[0x3D] = "WriteMemoryByAddress",
+	[0x3E] = "TesterPresent",
+	[0x83] = "AccessTimingParameter",
+	[0x84] = "SecuredDataTransmission",
+	[0x85] = "ControlDTCSetting",
+	[0x86] = "ResponseOnEvent",
+	[0x87] = "LinkControl",
+};
+
+static void xml_start(void *ud, const XML_Char *name, const XML_Char **attrs);
+static void xml_end(void *ud, const XML_Char *name);
+static void xml_data(void *ud, const XML_Char *data, int len);
+static bool xml_parse_file(struct XmlParser *parser, const char *path);
+static void xml_free(struct XmlNode *node);
+static struct XmlNode *xml_child(const struct XmlNode *node, const char *name);
+static struct XmlNode *xml_path(const struct XmlNode *node, const char *path);
+static const char *xml_attr(const struct XmlNode *node, const char *name);
+static const char *xml_text(const struct XmlNode *node);
+static const char *xml_attr_desc(const struct XmlNode *node, const char *name);
+static void ids_add(struct XmlNode *node);
+static struct XmlNode *ids_find(const char *id);
+static struct XmlNode *xml_ref(const struct XmlNode *ref);
+static uint32_t builder_string(struct Builder *b, const char *str);
+static struct DiagDbParam *builder_param(struct Builder *b);
+static void builder_service(struct Builder *b, uint8_t sid, const char *name,
+	int subfunction);
+static struct DidEntry *builder_did(struct Builder *b, uint16_t id, const char *name,
+	uint16_t flags);
+static void odx_walk(struct Builder *b, struct XmlNode *node);
+static void odx_service(struct Builder *b, struct XmlNode *service);
+static bool odx_const(const struct XmlNode *params, int byte_pos, int *bits, long *value);
+static void odx_params(struct Builder *b, const struct XmlNode *params, int base);
+static void odx_dop(struct DiagDbParam *param, struct Builder *b, const struct XmlNode *dop);
+static void cdd_walk(struct Builder *b, struct XmlNode *node);
+static void cdd_did(struct Builder *b, struct XmlNode *did);
+static void cdd_service(struct Builder *b, struct XmlNode *service);
+static const char *cdd_name(const struct XmlNode *node);
+static bool builder_write(struct Builder *b, const char *path);
+
+int main(int argc, char *argv[])
+{
+	const char *output = NULL;
+	int first_input = 1;
+	if (argc > 2 && !strcmp(argv[1], "-o"))
+	{
+		output = argv[2];
+		first_input = 3;
+	}
+	if (!output || first_input >= argc)
+	{
+		fprintf(stderr, "usage: %s -o output.bdb input.odx [input.cdd ...]\n", argv[0]);
+		return 1;
+	}
+
+	struct XmlNode **roots = (struct XmlNode **)calloc(argc, sizeof(struct XmlNode *));
+	for (int i = first_input; i < argc; ++i)
+	{
+		struct XmlParser parser = { NULL, NULL };
+		if (!xml_parse_file(&parser, argv[i]))
+			return 1;
+		roots[i] = parser.root;
+	}
+
+	struct Builder b;
+	memset(&b, 0, sizeof(b));
+	b.dids = (struct DidEntry *)calloc(65536, sizeof(struct DidEntry));
+	builder_string(&b, "");
+
+	for (int i = first_input; i < argc; ++i)
+	{
+		if (!roots[i])
+			continue;
+		if (!strcmp(roots[i]->name, "ODX"))
+		{
+			odx_walk(&b, roots[i]);
+		}
+		else if (!strcmp(roots[i]->name, "CANDELA"))
+		{
+			cdd_walk(&b, roots[i]);
+		}
+		else
+		{
+			fprintf(stderr, "%s: neither ODX nor CDD (root element %s)\n", argv[i], roots[i]->name);
+			return 1;
+		}
+	}
+
+	if (!builder_write(&b, output))
+		return 1;
+
+	for (int i = first_input; i < argc; ++i)
+		xml_free(roots[i]);
+	free(roots);
+	free(ids);
+	free(b.dids);
+	free(b.params);
+	free(b.strings);
+	return 0;
+}
+
+static void xml_start(void *ud, const XML_Char *name, const XML_Char **attrs)
+{
+	struct XmlParser *parser = (struct XmlParser *)ud;
+	struct XmlNode *node = (struct XmlNode *)calloc(1, sizeof(struct XmlNode));
+	node->name = strdup(name);
+	int num = 0;
+	while (attrs[num])
+		++num;
+	node->attrs = (char **)calloc(num + 1, sizeof(char *));
+	for (int i = 0; i < num; ++i)
+		node->attrs[i] = strdup(attrs[i]);
+
+	node->parent = parser->current;
+	if (parser->current)
+	{
+		if (parser->current->last)
+			parser->current->last->next = node;
+		else
+			parser->current->child = node;
+		parser->current->last = node;
+	}
+	else
+	{
+		parser->root = node;
+	}
+	parser->current = node;
+	ids_add(node);
+}
+
+static void xml_end(void *ud, const XML_Char *name)
+{
+	struct XmlParser *parser = (struct XmlParser *)ud;
+	struct XmlNode *node = parser->current;
+	// only the text of leaves is of any use, drop the whitespace between elements
+	if (node->child && node->text)
+	{
+		free(node->text);
+		node->text = NULL;
+		node->text_len = 0;
+	}
+	parser->current = node->parent;
+}
+
+static void xml_data(void *ud, const XML_Char *data, int len)
+{
+	struct XmlNode *node = ((struct XmlParser *)ud)->current;
+	if (!node || node->child)
+		return;
+	node->text = (char *)realloc(node->text, node->text_len + len + 1);
+	memcpy(node->text + node->text_len, data, len);
+	node->text_len += len;
+	node->text[node->text_len] = '\0';
+}
+
+static bool xml_parse_file(struct XmlParser *parser, const char *path)
+{
+	FILE *file = fopen(path, "rb");
+	if (!file)
+	{
+		fprintf(stderr, "cannot open %s\n", path);
+		return false;
+	}
+
+	XML_Parser xml = XML_ParserCreate(NULL);
+	XML_SetUserData(xml, parser);
+	XML_SetElementHandler(xml, xml_start, xml_end);
+	XML_SetCharacterDataHandler(xml, xml_data);
+
+	bool ok = true;
+	while (ok)
+	{
+		void *buf = XML_GetBuffer(xml, 1 << 16);
+		size_t len = fread(buf, 1, 1 << 16, file);
+		bool last = len < (1 << 16);
+		if (XML_STATUS_ERROR == XML_ParseBuffer(xml, len, last))
+		{
+			fprintf(stderr, "%s:%lu: %s\n", path, (unsigned long)XML_GetCurrentLineNumber(xml),
+				XML_ErrorString(XML_GetErrorCode(xml)));
+			ok = false;
+		}
+		if (last)
+			break;
+	}
+
+	XML_ParserFree(xml);
+	fclose(file);
+	return ok;
+}
+
+static void xml_free(struct XmlNode *node)
+{
+	while (node)
+	{
+		struct XmlNode *next = node->next;
+		xml_free(node->child);
+		for (char **attr = node->attrs; *attr; ++attr)
+			free(*attr);
+		free(node->attrs);
+		free(node->text);
+		free(node->name);
+		free(node);
+		node = next;
+	}
+}
+
+static struct XmlNode *xml_child(const struct XmlNode *node, const char *name)
+{
+	if (!node)
+		return NULL;
+	for (struct XmlNode *child = node->child; child; child = child->next)
+	{
+		if (!strcmp(child->name, name))
+			return child;
+	}
+	return NULL;
+}
+
+// follows a path of child elements separated with slashes
+static struct XmlNode *xml_path(const struct XmlNode *node, const char *path)
+{
+	char name[64];
+	while (node && *path)
+	{
+		size_t len = strcspn(path, "/");
+		if (len >= sizeof(name))
+			return NULL;
+		memcpy(name, path, len);
+		name[len] = '\0';
+		node = xml_child(node, name);
+		path += len;
+		if ('/' == *path)
+			++path;
+	}
+	return (struct XmlNode *)node;
+}
+
+static const char *xml_attr(const struct XmlNode *node, const char *name)
+{
+	if (!node)
+		return NULL;
+	for (char **attr = node->attrs; *attr; attr += 2)
+	{
+		if (!strcmp(attr[0], name))
+			return attr[1];
+	}
+	return NULL;
+}
+
+// trimmed text of an element, NULL if there is none
+static const char *xml_text(const struct XmlNode *node)
+{
+	if (!node || !node->text)
+		return NULL;
+	char *text = node->text;
+	while (isspace((unsigned char)*text))
+		++text;
+	char *end = text + strlen(text);
+	while (end > text && isspace((unsigned char)end[-1]))
+		*--end = '\0';
+	return text;
+}
+
+// looks for an attribute in an element and its descendants, depth first
+static const char *xml_attr_desc(const struct XmlNode *node, const char *name)
+{
+	const char *value = xml_attr(node, name);
+	for (struct XmlNode *child = node->child; child && !value; child = child->next)
+		value = xml_attr_desc(child, name);
+	return value;
+}
+
+static uint32_t ids_hash(const char *id)
+{
+	// FNV-1a
+	uint32_t hash = 2166136261u;
+	for (const char *c = id; *c; ++c)
+	{
+		hash ^= (unsigned char)*c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static void ids_add(struct XmlNode *node)
+{
+	const char *id = xml_attr(node, "ID");
+	if (!id)
+		id = xml_attr(node, "id");
+	if (!id)
+		return;
+
+	if (2 * (ids_num + 1) > ids_size)
+	{
+		size_t size = ids_size ? 2 * ids_size : 1024;
+		struct IdEntry *table = (struct IdEntry *)calloc(size, sizeof(struct IdEntry));
+		for (size_t i = 0; i < ids_size; ++i)
+		{
+			if (!ids[i].id)
+				continue;
+			size_t idx = ids_hash(ids[i].id) & (size - 1);
+			while (table[idx].id)
+				idx = (idx + 1) & (size - 1);
+			table[idx] = ids[i];
+		}
+		free(ids);
+		ids = table;
+		ids_size = size;
+	}
+
+	size_t idx = ids_hash(id) & (ids_size - 1);
+	while (ids[idx].id)
+	{
+		// the first definition wins
+		if (!strcmp(ids[idx].id, id))
+			return;
+		idx = (idx + 1) & (ids_size - 1);
+	}
+	ids[idx].id = id;
+	ids[idx].node = node;
+	++ids_num;
+}
+
+static struct XmlNode *ids_find(const char *id)
+{
+	if (!id || !ids_size)
+		return NULL;
+	size_t idx = ids_hash(id) & (ids_size - 1);
+	while (ids[idx].id)
+	{
+		if (!strcmp(ids[idx].id, id))
+			return ids[idx].node;
+		idx = (idx + 1) & (ids_size - 1);
+	}
+	return NULL;
+}
+
+// resolves an ODX reference element
+static struct XmlNode *xml_ref(const struct XmlNode *ref)
+{
+	return ids_find(xml_attr(ref, "ID-REF"));
+}
+
+static uint32_t builder_string(struct Builder *b, const char *str)
+{
+	// the first call stores the empty string at offset 0
+	if ((!str || !*str) && b->strings_len)
+		return 0;
+	if (!str)
+		str = "";
+	size_t len = strlen(str) + 1;
+	if (b->strings_len + len > b->strings_cap)
+	{
+		size_t cap = b->strings_cap ? b->strings_cap : 4096;
+		while (cap < b->strings_len + len)
+			cap *= 2;
+		b->strings = (char *)realloc(b->strings, cap);
+		b->strings_cap = cap;
+	}
+	uint32_t offset = b->strings_len;
+	memcpy(b->strings + offset, str, len);
+	b->strings_len += len;
+	return offset;
+}
+
+static struct DiagDbParam *builder_param(struct Builder *b)
+{
+	if (b->params_num == b->params_cap)
+	{
+		b->params_cap = b->params_cap ? 2 * b->params_cap : 256;
+		b->params = (struct DiagDbParam *)realloc(b->params,
+			b->params_cap * sizeof(struct DiagDbParam));
+	}
+	struct DiagDbParam *param = &b->params[b->params_num++];
+	memset(param, 0, sizeof(*param));
+	param->factor = 1.0;
+	return param;
+}
+
+// subfunction < 0 if a service has none
+static void builder_service(struct Builder *b, uint8_t sid, const char *name,
+	int subfunction)
+{
+	if (!b->services[sid])
+	{
+		b->services[sid] = true;
+		b->service_names[sid] = builder_string(b, uds_services[sid] ? uds_services[sid] : name);
+	}
+	if (subfunction >= 0)
+		b->subfunctions[sid][subfunction / 8] |= 1 << (subfunction % 8);
+
+	// sessions are the subfunctions of DiagnosticSessionControl
+	if (0x10 == sid && subfunction >= 0 && !b->sessions[subfunction & 0x7f])
+	{
+		b->sessions[subfunction & 0x7f] = true;
+		b->session_names[subfunction & 0x7f] = builder_string(b, name);
+	}
+}
+
+// returns NULL if the DID has been defined already, only flags are added then
+static struct DidEntry *builder_did(struct Builder *b, uint16_t id, const char *name,
+	uint16_t flags)
+{
+	struct DidEntry *entry = &b->dids[id];
+	if (entry->defined)
+	{
+		entry->did.flags |= flags;
+		return NULL;
+	}
+	entry->defined = true;
+	entry->did.id = id;
+	entry->did.flags = flags;
+	entry->did.name = builder_string(b, name);
+	entry->did.first_param = b->params_num;
+	++b->dids_num;
+	return entry;
+}
+
+static void odx_walk(struct Builder *b, struct XmlNode *node)
+{
+	for (; node; node = node->next)
+	{
+		if (!strcmp(node->name, "DIAG-SERVICE"))
+			odx_service(b, node);
+		else
+			odx_walk(b, node->child);
+	}
+}
+
+static void odx_service(struct Builder *b, struct XmlNode *service)
+{
+	const char *name = xml_text(xml_child(service, "SHORT-NAME"));
+	struct XmlNode *request = xml_ref(xml_child(service, "REQUEST-REF"));
+	struct XmlNode *request_params = xml_child(request, "PARAMS");
+	int bits;
+	long sid, value;
+	if (!odx_const(request_params, 0, &bits, &sid) || 8 != bits || sid < 0 || sid > 0xff)
+		return;
+
+	bool has_const = odx_const(request_params, 1, &bits, &value);
+	if ((0x22 == sid || 0x2E == sid) && has_const && 16 == bits)
+	{
+		// data follows the response SID and the identifier
+		struct XmlNode *params = request_params;
+		if (0x22 == sid)
+		{
+			struct XmlNode *response = xml_ref(xml_path(service, "POS-RESPONSE-REFS/POS-RESPONSE-REF"));
+			params = xml_child(response, "PARAMS");
+		}
+		struct DidEntry *entry = builder_did(b, value, name, 0x22 == sid ? DIAGDB_READ : DIAGDB_WRITE);
+		if (entry)
+		{
+			odx_params(b, params, -3);
+			entry->did.params_num = b->params_num - entry->did.first_param;
+			for (uint32_t i = entry->did.first_param; i < b->params_num; ++i)
+			{
+				uint32_t end = b->params[i].byte_pos + (b->params[i].bit_pos + b->params[i].bit_length + 7) / 8;
+				if (end > entry->did.length)
+					entry->did.length = end;
+			}
+		}
+		builder_service(b, sid, name, -1);
+	}
+	else
+	{
+		bool has_subfunction = has_const && 8 == bits;
+		if (has_subfunction && (value < 0 || value > 0xff))
+			return;
+		builder_service(b, sid, name, has_subfunction ? (int)value : -1);
+	}
+}
+
+// finds a constant parameter of a request at a given byte position
+static bool odx_const(const struct XmlNode *params, int byte_pos, int *bits, long *value)
+{
+	for (struct XmlNode *param = params ? params->child : NULL; param; param = param->next)
+	{
+		const char *type = xml_attr(param, "xsi:type");
+		if (!type || strcmp(type, "CODED-CONST"))
+			continue;
+		const char *pos = xml_text(xml_child(param, "BYTE-POSITION"));
+		if (!pos || byte_pos != atoi(pos))
+			continue;
+		const char *coded = xml_text(xml_child(param, "CODED-VALUE"));
+		const char *length = xml_text(xml_path(param, "DIAG-CODED-TYPE/BIT-LENGTH"));
+		if (!coded || !length)
+			return false;
+		*value = strtol(coded, NULL, 0);
+		*bits = atoi(length);
+		return true;
+	}
+	return false;
+}
+
+// flattens VALUE parameters, structures included, base is added to byte positions
+static void odx_params(struct Builder *b, const struct XmlNode *params, int base)
+{
+	for (struct XmlNode *param = params ? params->child : NULL; param; param = param->next)
+	{
+		const char *type = xml_attr(param, "xsi:type");
+		if (!type || strcmp(type, "VALUE"))
+			continue;
+		const char *pos = xml_text(xml_child(param, "BYTE-POSITION"));
+		const char *bit_pos = xml_text(xml_child(param, "BIT-POSITION"));
+		int byte_pos = base + (pos ? atoi(pos) : 0);
+		struct XmlNode *dop = xml_ref(xml_child(param, "DOP-REF"));
+		if (!dop || byte_pos < 0)
+			continue;
+
+		if (!strcmp(dop->name, "STRUCTURE"))
+		{
+			odx_params(b, xml_child(dop, "PARAMS"), byte_pos);
+			continue;
+		}
+		struct DiagDbParam *p = builder_param(b);
+		p->name = builder_string(b, xml_text(xml_child(param, "SHORT-NAME")));
+		p->byte_pos = byte_pos;
+		p->bit_pos = bit_pos ? atoi(bit_pos) : 0;
+		odx_dop(p, b, dop);
+	}
+}
+
+static void odx_dop(struct DiagDbParam *param, struct Builder *b, const struct XmlNode *dop)
+{
+	struct XmlNode *coded = xml_child(dop, "DIAG-CODED-TYPE");
+	const char *base_type = xml_attr(coded, "BASE-DATA-TYPE");
+	const char *encoding = xml_attr(coded, "ENCODING");
+	param->type = DP_UINT;
+	if (encoding && !strncmp(encoding, "BCD", 3))
+		param->type = DP_BCD;
+	else if (!base_type || !strcmp(base_type, "A_UINT32"))
+		param->type = DP_UINT;
+	else if (!strcmp(base_type, "A_INT32"))
+		param->type = DP_SINT;
+	else if (!strncmp(base_type, "A_FLOAT", 7))
+		param->type = DP_FLOAT;
+	else if (strstr(base_type, "STRING"))
+		param->type = DP_ASCII;
+	else
+		param->type = DP_BYTES;
+
+	// variable length values are described by their maximum length in bytes
+	const char *length = xml_text(xml_child(coded, "BIT-LENGTH"));
+	if (length)
+		param->bit_length = atoi(length);
+	else if ((length = xml_text(xml_child(coded, "MAX-LENGTH"))))
+		param->bit_length = 8 * atoi(length);
+	else if ((length = xml_text(xml_child(coded, "MIN-LENGTH"))))
+		param->bit_length = 8 * atoi(length);
+
+	struct XmlNode *method = xml_child(dop, "COMPU-METHOD");
+	const char *category = xml_text(xml_child(method, "CATEGORY"));
+	if (category && strstr(category, "LINEAR"))
+	{
+		struct XmlNode *coeffs = xml_path(method,
+			"COMPU-INTERNAL-TO-PHYS/COMPU-SCALES/COMPU-SCALE/COMPU-RATIONAL-COEFFS");
+		struct XmlNode *numerator = xml_child(coeffs, "COMPU-NUMERATOR");
+		struct XmlNode *v = xml_child(numerator, "V");
+		double offset = v ? atof(xml_text(v) ? xml_text(v) : "0") : 0.0;
+		v = v ? v->next : NULL;
+		double factor = v ? atof(xml_text(v) ? xml_text(v) : "1") : 1.0;
+		const char *denominator = xml_text(xml_path(coeffs, "COMPU-DENOMINATOR/V"));
+		double den = denominator ? atof(denominator) : 1.0;
+		if (0.0 == den)
+			den = 1.0;
+		param->factor = factor / den;
+		param->offset = offset / den;
+	}
+
+	struct XmlNode *unit = xml_ref(xml_child(dop, "UNIT-REF"));
+	const char *unit_name = xml_text(xml_child(unit, "DISPLAY-NAME"));
+	if (!unit_name)
+		unit_name = xml_text(xml_child(unit, "SHORT-NAME"));
+	param->unit = builder_string(b, unit_name);
+}
+
+static void cdd_walk(struct Builder *b, struct XmlNode *node)
+{
+	for (; node; node = node->next)
+	{
+		if (!strcmp(node->name, "DID") && xml_attr(node, "n"))
+			cdd_did(b, node);
+		else if (!strcmp(node->name, "PROTOCOLSERVICE"))
+			cdd_service(b, node);
+		else
+			cdd_walk(b, node->child);
+	}
+}
+
+// data objects of a DID follow one another, positions are not given
+static void cdd_did(struct Builder *b, struct XmlNode *did)
+{
+	long id = strtol(xml_attr(did, "n"), NULL, 0);
+	if (id < 0 || id > 0xffff)
+		return;
+	struct DidEntry *entry = builder_did(b, id, cdd_name(did), DIAGDB_READ);
+	if (!entry)
+		return;
+
+	uint32_t bit = 0;
+	struct XmlNode *structure = xml_child(did, "STRUCTURE");
+	for (struct XmlNode *obj = structure ? structure->child : NULL; obj; obj = obj->next)
+	{
+		if (strcmp(obj->name, "DATAOBJ"))
+			continue;
+		struct XmlNode *type = ids_find(xml_attr(obj, "dtref"));
+		struct XmlNode *coded = xml_child(type, "CVALUETYPE");
+		if (!coded)
+			continue;
+
+		struct DiagDbParam *p = builder_param(b);
+		p->name = builder_string(b, cdd_name(obj));
+		p->byte_pos = bit / 8;
+		p->bit_pos = bit % 8;
+		const char *bl = xml_attr(coded, "bl");
+		const char *maxsz = xml_attr(coded, "maxsz");
+		const char *qty = xml_attr(coded, "qty");
+		p->bit_length = bl ? atoi(bl) : 8;
+		// fields repeat the coded value up to maxsz times
+		if (qty && !strcmp(qty, "field") && maxsz)
+			p->bit_length *= atoi(maxsz);
+
+		const char *enc = xml_attr(coded, "enc");
+		if (!enc || !strcmp(enc, "uns"))
+			p->type = DP_UINT;
+		else if (!strcmp(enc, "sgn"))
+			p->type = DP_SINT;
+		else if (!strcmp(enc, "flt") || !strcmp(enc, "dbl"))
+			p->type = DP_FLOAT;
+		else if (!strcmp(enc, "asc") || !strcmp(enc, "utf"))
+			p->type = DP_ASCII;
+		else if (!strcmp(enc, "bcd"))
+			p->type = DP_BCD;
+		else
+			p->type = DP_BYTES;
+
+		if (!strcmp(type->name, "LINCOMP"))
+		{
+			const char *factor = xml_attr_desc(type, "f");
+			const char *offset = xml_attr_desc(type, "o");
+			if (factor)
+				p->factor = atof(factor);
+			if (offset)
+				p->offset = atof(offset);
+		}
+		p->unit = builder_string(b, xml_attr_desc(type, "unit"));
+		bit += p->bit_length;
+	}
+	entry->did.params_num = b->params_num - entry->did.first_param;
+	entry->did.length = (bit + 7) / 8;
+}
+
+// constant components of a request give the SID and the subfunction
+static void cdd_service(struct Builder *b, struct XmlNode *service)
+{
+	struct XmlNode *request = xml_child(service, "REQ");
+	long values[2];
+	int bits[2];
+	int num = 0;
+	for (struct XmlNode *comp = request ? request->child : NULL; comp && num < 2; comp = comp->next)
+	{
+		if (strcmp(comp->name, "CONSTCOMP"))
+			break;
+		const char *v = xml_attr(comp, "v");
+		const char *bl = xml_attr(comp, "bl");
+		values[num] = v ? strtol(v, NULL, 0) : -1;
+		bits[num] = bl ? atoi(bl) : 8;
+		++num;
+	}
+	if (!num || 8 != bits[0] || values[0] < 0 || values[0] > 0xff)
+		return;
+	int subfunction = (num > 1 && 8 == bits[1] && values[1] >= 0) ? (int)values[1] : -1;
+	if (subfunction > 0xff)
+		return;
+	builder_service(b, values[0], cdd_name(service), subfunction);
+}
+
+// CDD names are translated, the first translation is used
+static const char *cdd_name(const struct XmlNode *node)
+{
+	const char *name = xml_text(xml_path(node, "NAME/TUV"));
+	if (!name)
+		name = xml_text(xml_child(node, "QUAL"));
+	return name;
+}
+
+static size_t builder_align(size_t offset)
+{
+	return (offset + 7) & ~(size_t)7;
+}
+
+static bool builder_write(struct Builder *b, const char *path)
+{
+	struct DiagDbHeader hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, DIAGDB_MAGIC, sizeof(hdr.magic));
+	hdr.version = DIAGDB_VERSION;
+
+	// DIDs sorted by identifier, the index keeps the load factor below one half
+	struct DiagDbDid *dids = (struct DiagDbDid *)calloc(b->dids_num ? b->dids_num : 1, sizeof(struct DiagDbDid));
+	uint32_t dids_num = 0;
+	for (int id = 0; id < 65536; ++id)
+	{
+		if (b->dids[id].defined)
+			dids[dids_num++] = b->dids[id].did;
+	}
+	uint32_t index_size = 16;
+	while (index_size < 2 * dids_num)
+		index_size *= 2;
+	uint32_t *did_index = (uint32_t *)calloc(index_size, sizeof(uint32_t));
+	for (uint32_t i = 0; i < dids_num; ++i)
+	{
+		uint32_t idx = diagdb_hash(dids[i].id, index_size);
+		while (did_index[idx])
+			idx = (idx + 1) & (index_size - 1);
+		did_index[idx] = i + 1;
+	}
+
+	struct DiagDbService services[256];
+	uint16_t service_index[256];
+	uint8_t subfunctions[256 * 256];
+	uint32_t services_num = 0;
+	uint32_t subfunctions_num = 0;
+	memset(service_index, 0, sizeof(service_index));
+	for (int sid = 0; sid < 256; ++sid)
+	{
+		if (!b->services[sid])
+			continue;
+		struct DiagDbService *service = &services[services_num];
+		memset(service, 0, sizeof(*service));
+		service->sid = sid;
+		service->name = b->service_names[sid];
+		service->first_subfunction = subfunctions_num;
+		for (int sub = 0; sub < 256; ++sub)
+		{
+			if (b->subfunctions[sid][sub / 8] & (1 << (sub % 8)))
+				subfunctions[subfunctions_num++] = sub;
+		}
+		service->subfunctions_num = subfunctions_num - service->first_subfunction;
+		service_index[sid] = ++services_num;
+	}
+
+	struct DiagDbSession sessions[256];
+	uint16_t session_index[256];
+	uint32_t sessions_num = 0;
+	memset(session_index, 0, sizeof(session_index));
+	for (int id = 0; id < 256; ++id)
+	{
+		if (!b->sessions[id])
+			continue;
+		memset(&sessions[sessions_num], 0, sizeof(struct DiagDbSession));
+		sessions[sessions_num].id = id;
+		sessions[sessions_num].name = b->session_names[id];
+		session_index[id] = ++sessions_num;
+	}
+
+	size_t offset = builder_align(sizeof(hdr));
+	hdr.dids_num = dids_num;
+	hdr.dids_offset = offset;
+	offset = builder_align(offset + dids_num * sizeof(struct DiagDbDid));
+	hdr.did_index_size = index_size;
+	hdr.did_index_offset = offset;
+	offset = builder_align(offset + index_size * sizeof(uint32_t));
+	hdr.params_num = b->params_num;
+	hdr.params_offset = offset;
+	offset = builder_align(offset + b->params_num * sizeof(struct DiagDbParam));
+	hdr.services_num = services_num;
+	hdr.services_offset = offset;
+	offset = builder_align(offset + services_num * sizeof(struct DiagDbService));
+	hdr.service_index_offset = offset;
+	offset = builder_align(offset + sizeof(service_index));
+	hdr.subfunctions_num = subfunctions_num;
+	hdr.subfunctions_offset = offset;
+	offset = builder_align(offset + subfunctions_num);
+	hdr.sessions_num = sessions_num;
+	hdr.sessions_offset = offset;
+	offset = builder_align(offset + sessions_num * sizeof(struct DiagDbSession));
+	hdr.session_index_offset = offset;
+	offset = builder_align(offset + sizeof(session_index));
+	hdr.strings_size = b->strings_len;
+	hdr.strings_offset = offset;
+	offset = builder_align(offset + b->strings_len);
+	hdr.size = offset;
+
+	char *image = (char *)calloc(1, hdr.size);
+	if (!image)
+	{
+		fprintf(stderr, "not enough memory for %s\n", path);
+		free(did_index);
+		free(dids);
+		return false;
+	}
+	memcpy(image, &hdr, sizeof(hdr));
+	memcpy(image + hdr.dids_offset, dids, dids_num * sizeof(struct DiagDbDid));
+	memcpy(image + hdr.did_index_offset, did_index, index_size * sizeof(uint32_t));
+	memcpy(image + hdr.params_offset, b->params, b->params_num * sizeof(struct DiagDbParam));
+	memcpy(image + hdr.services_offset, services, services_num * sizeof(struct DiagDbService));
+	memcpy(image + hdr.service_index_offset, service_index, sizeof(service_index));
+	memcpy(image + hdr.subfunctions_offset, subfunctions, subfunctions_num);
+	memcpy(image + hdr.sessions_offset, sessions, sessions_num * sizeof(struct DiagDbSession));
+	memcpy(image + hdr.session_index_offset, session_index, sizeof(session_index));
+	memcpy(image + hdr.strings_offset, b->strings, b->strings_len);
+
+	// a running simulator maps the database, so a new file is written
+	// and moved into place instead of truncating the mapped one
+	size_t len = strlen(path) + 5;
+	char *tmp_path = (char *)malloc(len);
+	FILE *file = NULL;
+	if (tmp_path)
+	{
+		snprintf(tmp_path, len, "%s.tmp", path);
+		file = fopen(tmp_path, "wb");
+	}
+	bool ok = NULL != file;
+	if (file)
+	{
+		ok = 1 == fwrite(image, hdr.size, 1, file);
+		ok = (0 == fclose(file)) && ok;
+		if (!ok || rename(tmp_path, path) < 0)
+		{
+			remove(tmp_path);
+			ok = false;
+		}
+	}
+	free(tmp_path);
+
+	if (ok)
+		printf("%s: %u DIDs, %u services, %u sessions, %u bytes\n", path,
+			dids_num, services_num, sessions_num, hdr.size);
+	else
+		fprintf(stderr, "cannot write %s\n", path);
+
+	free(image);
+	free(did_index);
+	free(dids);
+	return ok;
+}